@@ -7,39 +7,94 @@
 #define ClockHeight 30
 #define ClockHour 7
 #define ClockMin 11
-#define ClockSec 12
-#define HandWidth 1.5
-#define HandOffset 1.5
 
-struct timeval clock_zero_time;
-struct timeval clock_tick;
+Xwtime clock_zero_time;
+Xwtime clock_tick;
 
 
+/* Hand tips relative to the clock's center, indexed by position. They are
+   truncated as offsets from a typical center, so they match computing
+   (int)(center + offset) directly. */
+
+#define TipCenter 64
+
+typedef struct {
+  short dx, dy;
+} HandTip;
+
+static HandTip hour_tips[HOUR_PER_CYCLE];
+static HandTip min_tips[MIN_PER_HOUR];
+static int hand_tips_ready;
+
+static void
+init_hand_tips(HandTip *tips, int hand_length, int value_cycle)
+{
+  int i;
+  for (i = 0; i < value_cycle; i++) {
+    double sinv = sin(i * 2 * M_PI / value_cycle);
+    double cosv = cos(i * 2 * M_PI / value_cycle);
+    tips[i].dx = (short)((int)(TipCenter + hand_length * sinv) - TipCenter);
+    tips[i].dy = (short)((int)(TipCenter - hand_length * cosv) - TipCenter);
+  }
+}
+
 static void
-draw_hand(Port *port, Drawable drawable, int xin, int yin, int hand_length,
-	  int value, int value_cycle, int thin)
+set_hand(XSegment *seg, int x, int y, const HandTip *tip)
+{
+  seg->x1 = x;
+  seg->y1 = y;
+  seg->x2 = x + tip->dx;
+  seg->y2 = y + tip->dy;
+}
+
+
+/* The clock face, a white circle with a thick black border, is drawn once
+   per port. clock_face_gc clips copies of it to the circle, so the picture
+   shows around it. */
+
+#define FaceBorder 2
+#define FaceWidth (ClockWidth + 2 * FaceBorder)
+#define FaceHeight (ClockHeight + 2 * FaceBorder)
+
+void
+init_clock(Port *port)
 {
-  double sinv = sin(value * 2 * M_PI / value_cycle);
-  double cosv = cos(value * 2 * M_PI / value_cycle);
-
-  GC gc = (thin ? port->clock_hand_gc : port->clock_fore_gc);
-  XDrawLine(port->display, drawable, gc, xin, yin,
-	    (int)(xin + hand_length * sinv), (int)(yin - hand_length * cosv));
-
-#if 0
-  double x = xin - HandOffset * sinv + 1;
-  double y = yin + HandOffset * cosv + 1;
-  XPoint points[4];
-  points[0].x = (int)(x + HandWidth * cosv);
-  points[0].y = (int)(y + HandWidth * sinv);
-  points[1].x = (int)(x + hand_length * sinv);
-  points[1].y = (int)(y - hand_length * cosv);
-  points[2].x = (int)(x - HandWidth * cosv);
-  points[2].y = (int)(y - HandWidth * sinv);
-  points[4] = points[0];
-  XDrawLines(port->display, drawable, port->clock_fore_gc,
-	     points, 3, CoordModeOrigin);
-#endif
+  Pixmap mask;
+  GC mask_gc;
+  XGCValues gcv;
+
+  if (!hand_tips_ready) {
+    init_hand_tips(hour_tips, ClockHour, HOUR_PER_CYCLE);
+    init_hand_tips(min_tips, ClockMin, MIN_PER_HOUR);
+    hand_tips_ready = 1;
+  }
+
+  port->clock_face = XCreatePixmap(port->display, port->drawable,
+				   FaceWidth, FaceHeight, port->depth);
+  XFillArc(port->display, port->clock_face, port->white_gc,
+	   FaceBorder, FaceBorder, ClockWidth, ClockHeight, 0, 23040);
+  XDrawArc(port->display, port->clock_face, port->clock_fore_gc,
+	   FaceBorder, FaceBorder, ClockWidth, ClockHeight, 0, 23040);
+
+  mask = XCreatePixmap(port->display, port->drawable,
+		       FaceWidth, FaceHeight, 1);
+  gcv.foreground = 0;
+  gcv.line_width = 3;
+  gcv.cap_style = CapRound;
+  mask_gc = XCreateGC(port->display, mask,
+		      GCForeground | GCLineWidth | GCCapStyle, &gcv);
+  XFillRectangle(port->display, mask, mask_gc, 0, 0, FaceWidth, FaceHeight);
+  XSetForeground(port->display, mask_gc, 1);
+  XFillArc(port->display, mask, mask_gc,
+	   FaceBorder, FaceBorder, ClockWidth, ClockHeight, 0, 23040);
+  XDrawArc(port->display, mask, mask_gc,
+	   FaceBorder, FaceBorder, ClockWidth, ClockHeight, 0, 23040);
+  XFreeGC(port->display, mask_gc);
+
+  gcv.clip_mask = mask;
+  port->clock_face_gc = XCreateGC(port->display, port->drawable,
+				  GCClipMask, &gcv);
+  XFreePixmap(port->display, mask);
 }
 
 
@@ -48,7 +103,8 @@ draw_1_clock(Hand *hand, int seconds)
 {
   Port *port = hand->port;
   PictureList *pl;
-  int x, y;
+  XSegment hands[2];
+  int x, y, nhands = 0;
   int hour, min;
 
   if (!hand->slideshow)
@@ -58,29 +114,29 @@ draw_1_clock(Hand *hand, int seconds)
   x = pl->clock_x_off;
   y = pl->clock_y_off;
 
-  XFillArc(port->display, hand->w, port->white_gc,
-	   x, y, ClockWidth, ClockHeight, 0, 23040);
-  XDrawArc(port->display, hand->w, port->clock_fore_gc,
-	   x, y, ClockWidth, ClockHeight, 0, 23040);
+  XSetClipOrigin(port->display, port->clock_face_gc,
+		 x - FaceBorder, y - FaceBorder);
+  XCopyArea(port->display, port->clock_face, hand->w, port->clock_face_gc,
+	    0, 0, FaceWidth, FaceHeight, x - FaceBorder, y - FaceBorder);
   x += ClockWidth / 2;
   y += ClockHeight / 2;
   min = (seconds + 5) / SEC_PER_MIN;
+  hand->clock_minutes = min;
   hour = min / MIN_PER_HOUR;
   min %= MIN_PER_HOUR;
-  seconds %= SEC_PER_MIN;
 
   if (hour)
-    draw_hand(port, hand->w, x, y, ClockHour, hour, HOUR_PER_CYCLE, 0);
-  draw_hand(port, hand->w, x, y, ClockMin, min, MIN_PER_HOUR, 0);
-  /* draw_hand(port, hand->w, x, y, ClockSec, seconds, SEC_PER_MIN, 1); */
+    set_hand(&hands[nhands++], x, y, &hour_tips[hour % HOUR_PER_CYCLE]);
+  set_hand(&hands[nhands++], x, y, &min_tips[min]);
+  XDrawSegments(port->display, hand->w, port->clock_fore_gc, hands, nhands);
 }
 
 
 static int
-now_to_clock_sec(const struct timeval *now_ptr)
+now_to_clock_sec(const Xwtime *now_ptr)
 {
-  struct timeval now;
-  struct timeval diff;
+  Xwtime now;
+  Xwtime diff;
 
   if (now_ptr)
     now = *now_ptr;
@@ -92,24 +148,27 @@ now_to_clock_sec(const struct timeval *now_ptr)
   else
     xwSUBTIME(diff, clock_zero_time, now);
 
-  return diff.tv_sec + (diff.tv_usec >= 500000 ? 1 : 0);
+  return xwTIMESEC(diff + NANO_PER_SEC / 2);
 }
 
 void
-draw_clock(Hand *h, const struct timeval *now)
+draw_clock(Hand *h, const Xwtime *now)
 {
   draw_1_clock(h, now_to_clock_sec(now));
   h->clock = 1;
 }
 
+/* Called every clock tick; only redraws clocks whose minute has changed.
+   Exposures and new slides redraw through draw_clock. */
 void
-draw_all_clocks(const struct timeval *now)
+draw_all_clocks(const Xwtime *now)
 {
     Hand *h;
     int i, sec = now_to_clock_sec(now);
+    int min = (sec + 5) / SEC_PER_MIN;
     for (i = 0; i < nports; i++) {
 	for (h = ports[i]->hands; h; h = h->next) {
-	    if (h->mapped)
+	    if (h->mapped && (!h->clock || h->clock_minutes != min))
 		draw_1_clock(h, sec);
 	    h->clock = 1;
 	}
@@ -129,13 +188,14 @@ erase_clock(Hand *hand)
 
   pl = (PictureList *)(hand->slideshow->images[hand->slide]->user_data);
 
-  XCopyArea(port->display, pl->frames[port->port_number][hand->slide].pixmap,
+  XCopyArea(port->display, slide_pixmap(hand->slideshow, hand->slide, port),
 	    hand->w,
 	    port->clock_fore_gc,
 	    pl->clock_x_off - 2, pl->clock_y_off - 2,
 	    ClockWidth + 4, ClockHeight + 4,
 	    pl->clock_x_off - 2, pl->clock_y_off - 2);
   hand->clock = 0;
+  hand->clock_minutes = -1;
 }
 
 void
@@ -25,8 +25,7 @@ typedef struct {
 
   Gif_Stream *stream;
 
-  Gif_Code *prefix;
-  uint8_t *suffix;
+  uint32_t *offset;
   uint16_t *length;
 
   uint16_t width;
@@ -161,81 +160,32 @@ gif_read_error(Gif_Context *gfc, int is_error, const char *text)
 }
 
 
-static uint8_t
-one_code(Gif_Context *gfc, Gif_Code code)
+static inline uint64_t
+load_le64(const uint8_t *p)
 {
-  uint8_t *suffixes = gfc->suffix;
-  Gif_Code *prefixes = gfc->prefix;
-  uint8_t *ptr;
-  int lastsuffix;
-  uint16_t codelength = gfc->length[code];
-
-  gfc->decodepos += codelength;
-  ptr = gfc->image + gfc->decodepos;
-  if (ptr > gfc->maximage || !codelength) {
-    gif_read_error(gfc, 1, (!codelength ? "bad code" : "too much image data"));
-    /* 5/26/98 It's not good enough simply to count an error, because in the
-       read_image_data function, if code == next_code, we will store a byte in
-       gfc->image[gfc->decodepos-1]. Thus, fix decodepos so it's w/in the
-       image. */
-    gfc->decodepos = gfc->maximage - gfc->image;
-    return 0;
-  }
-
-  /* codelength will always be greater than 0. */
-  do {
-    lastsuffix = suffixes[code];
-    *--ptr = lastsuffix;
-    code = prefixes[code];
-  } while (--codelength > 0);
-
-  /* return the first pixel in the code, which, since we walked backwards
-     through the code, was the last suffix we processed. */
-  return lastsuffix;
+  return (uint64_t) p[0] | ((uint64_t) p[1] << 8)
+    | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24)
+    | ((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40)
+    | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
 }
 
-static int
-read_image_block(Gif_Reader *grr, uint8_t *buffer, int *bit_pos_store,
-		 int *bit_len_store, int bits_needed)
-{
-  int bit_position = *bit_pos_store;
-  int bit_length = *bit_len_store;
-  uint8_t block_len;
-
-  while (bit_position + bits_needed > bit_length) {
-    /* Read in the next data block. */
-    if (bit_position >= 8) {
-      /* Need to shift down the upper, unused part of 'buffer' */
-      int i = bit_position / 8;
-      buffer[0] = buffer[i];
-      buffer[1] = buffer[i+1];
-      bit_position -= i * 8;
-      bit_length -= i * 8;
-    }
-    block_len = gifgetbyte(grr);
-    GIF_DEBUG(("\nimage_block(%d)", block_len));
-    if (block_len == 0) return 0;
-    gifgetblock(buffer + bit_length / 8, block_len, grr);
-    bit_length += block_len * 8;
-  }
-
-  *bit_pos_store = bit_position;
-  *bit_len_store = bit_length;
-  return 1;
-}
-
-
 static void
 read_image_data(Gif_Context *gfc, Gif_Reader *grr)
 {
-  /* we need a bit more than GIF_MAX_BLOCK in case a single code is split
-     across blocks */
-  uint8_t buffer[GIF_MAX_BLOCK + 5];
+  uint8_t buffer[GIF_MAX_BLOCK];
+  int buffer_pos;
+  int buffer_len;
+  int end_of_blocks;
   int i;
-  uint32_t accum;
 
-  int bit_position;
-  int bit_length;
+  /* Bits not yet consumed, least significant first. */
+  uint64_t bits;
+  int nbits;
+
+  uint8_t *image = gfc->image;
+  uint32_t *offset = gfc->offset;
+  uint16_t *length = gfc->length;
+  uint32_t last_pos;
 
   Gif_Code code;
   Gif_Code old_code;
@@ -260,21 +210,20 @@ read_image_data(Gif_Context *gfc, Gif_Reader *grr)
     min_code_size = 2;
   }
   clear_code = 1 << min_code_size;
-  for (code = 0; code < clear_code; code++) {
-    gfc->prefix[code] = 49428;
-    gfc->suffix[code] = (uint8_t)code;
-    gfc->length[code] = 1;
-  }
+  for (code = 0; code < clear_code; code++)
+    length[code] = 1;
   eoi_code = clear_code + 1;
 
   next_code = eoi_code;
   bits_needed = min_code_size + 1;
 
   code = clear_code;
+  last_pos = 0;
 
-  bit_length = bit_position = 0;
-  /* Thus the 'Read in the next data block.' code below will be invoked on the
-     first time through: exactly right! */
+  bits = 0;
+  nbits = 0;
+  buffer_pos = buffer_len = 0;
+  end_of_blocks = 0;
 
   while (1) {
 
@@ -282,25 +231,41 @@ read_image_data(Gif_Context *gfc, Gif_Reader *grr)
 
     /* GET A CODE INTO THE 'code' VARIABLE.
      *
-     * 9.Dec.1998 - Rather than maintain a byte pointer and a bit offset into
-     * the current byte (and the processing associated with that), we maintain
-     * one number: the offset, in bits, from the beginning of 'buffer'. This
-     * much cleaner choice was inspired by Patrick J. Naughton
-     * <naughton@wind.sun.com>'s GIF-reading code, which does the same thing.
-     * His code distributed as part of XV in xvgif.c. */
-
-    if (bit_position + bits_needed > bit_length)
-      /* Read in the next data block. */
-      if (!read_image_block(grr, buffer, &bit_position, &bit_length,
-			    bits_needed))
-	goto zero_length_block;
-
-    i = bit_position / 8;
-    accum = buffer[i] + (buffer[i+1] << 8);
-    if (bits_needed >= 8)
-      accum |= (buffer[i+2]) << 16;
-    code = (Gif_Code)((accum >> (bit_position % 8)) & CUR_CODE_MASK);
-    bit_position += bits_needed;
+     * Refill the bit buffer only when it runs low: eight bytes at a time
+     * while the current data block has them, otherwise byte by byte, reading
+     * further data blocks as necessary. */
+
+    if (nbits < bits_needed) {
+      if (buffer_len - buffer_pos >= 8) {
+	int nbytes = (63 - nbits) >> 3;
+	bits |= load_le64(buffer + buffer_pos) << nbits;
+	buffer_pos += nbytes;
+	nbits += nbytes * 8;
+	bits &= ((uint64_t) 1 << nbits) - 1;
+      } else {
+	while (nbits <= 56 && !end_of_blocks) {
+	  if (buffer_pos == buffer_len) {
+	    /* Read in the next data block. */
+	    buffer_len = gifgetbyte(grr);
+	    buffer_pos = 0;
+	    GIF_DEBUG(("\nimage_block(%d)", buffer_len));
+	    if (buffer_len == 0) {
+	      end_of_blocks = 1;
+	      break;
+	    }
+	    gifgetblock(buffer, buffer_len, grr);
+	  }
+	  bits |= (uint64_t) buffer[buffer_pos++] << nbits;
+	  nbits += 8;
+	}
+	if (nbits < bits_needed)
+	  goto zero_length_block;
+      }
+    }
+
+    code = (Gif_Code)(bits & CUR_CODE_MASK);
+    bits >>= bits_needed;
+    nbits -= bits_needed;
 
     GIF_DEBUG(("%d", code));
 
@@ -332,22 +297,49 @@ read_image_data(Gif_Context *gfc, Gif_Reader *grr)
 
     /* PROCESS THE CURRENT CODE and define the next code. If no meaningful
      * next code should be defined, then we have set next_code to either
-     * 'eoi_code' or 'clear_code' -- so we'll store useless prefix/suffix data
-     * in a useless place. */
+     * 'eoi_code' or 'clear_code' -- so we'll store useless data in a useless
+     * place.
+     *
+     * Every code's string was written to the image when the code was
+     * defined: it is old_code's string, which starts at last_pos, plus the
+     * first pixel of the code after it. So rather than following a prefix
+     * chain, copy the string from there. */
 
-    /* *First,* set up the prefix and length for the next code
+    /* *First,* set up the offset and length for the next code
        (in case code == next_code). */
-    gfc->prefix[next_code] = old_code;
-    gfc->length[next_code] = gfc->length[old_code] + 1;
-
-    /* Use one_code to process code. It's nice that it returns the first
-       pixel in code: that's what we need. */
-    gfc->suffix[next_code] = one_code(gfc, code);
-
-    /* Special processing if code == next_code: we didn't know code's final
-       suffix when we called one_code, but we do now. */
-    if (code == next_code)
-      gfc->image[gfc->decodepos - 1] = gfc->suffix[next_code];
+    offset[next_code] = last_pos;
+    length[next_code] = length[old_code] + 1;
+
+    {
+      uint16_t codelength = length[code];
+      uint8_t *ptr = image + gfc->decodepos;
+      last_pos = gfc->decodepos;
+      gfc->decodepos += codelength;
+
+      if (ptr + codelength > gfc->maximage || !codelength) {
+	gif_read_error(gfc, 1, (!codelength ? "bad code"
+				: "too much image data"));
+	/* 5/26/98 It's not good enough simply to count an error, because if
+	   code == next_code, we will store a byte in
+	   gfc->image[gfc->decodepos-1]. Thus, fix decodepos so it's w/in the
+	   image. */
+	gfc->decodepos = gfc->maximage - image;
+	if (code == next_code)
+	  image[gfc->decodepos - 1] = 0;
+
+      } else if (code < clear_code)
+	*ptr = (uint8_t) code;
+
+      else {
+	/* If code == next_code, we didn't know its final pixel when we defined
+	   it, but it's the first pixel of old_code, which we just copied. */
+	const uint8_t *src = image + offset[code];
+	int n = (code == next_code ? codelength - 1 : codelength);
+	memcpy(ptr, src, n);
+	if (code == next_code)
+	  ptr[n] = src[0];
+      }
+    }
 
     /* Increment next_code except for the 'clear_code' special case (that's
        when we're reading at the end of a GIF) */
@@ -364,12 +356,14 @@ read_image_data(Gif_Context *gfc, Gif_Reader *grr)
   }
 
   /* read blocks until zero-length reached. */
-  i = gifgetbyte(grr);
-  GIF_DEBUG(("\nafter_image(%d)\n", i));
-  while (i > 0) {
-    gifgetblock(buffer, i, grr);
+  if (!end_of_blocks) {
     i = gifgetbyte(grr);
     GIF_DEBUG(("\nafter_image(%d)\n", i));
+    while (i > 0) {
+      gifgetblock(buffer, i, grr);
+      i = gifgetbyte(grr);
+      GIF_DEBUG(("\nafter_image(%d)\n", i));
+    }
   }
 
   /* zero-length block reached. */
@@ -529,19 +523,17 @@ Gif_FullUncompressImage(Gif_Image *gfi, Gif_ReadErrorHandler h, void *hthunk)
 
   fake_gfs.errors = 0;
   gfc.stream = &fake_gfs;
-  gfc.prefix = Gif_NewArray(Gif_Code, GIF_MAX_CODE);
-  gfc.suffix = Gif_NewArray(uint8_t, GIF_MAX_CODE);
+  gfc.offset = Gif_NewArray(uint32_t, GIF_MAX_CODE);
   gfc.length = Gif_NewArray(uint16_t, GIF_MAX_CODE);
   gfc.handler = h;
   gfc.handler_thunk = hthunk;
 
-  if (gfi && gfc.prefix && gfc.suffix && gfc.length && gfi->compressed) {
+  if (gfi && gfc.offset && gfc.length && gfi->compressed) {
     make_data_reader(&grr, gfi->compressed, gfi->compressed_len);
     ok = uncompress_image(&gfc, gfi, &grr);
   }
 
-  Gif_DeleteArray(gfc.prefix);
-  Gif_DeleteArray(gfc.suffix);
+  Gif_DeleteArray(gfc.offset);
   Gif_DeleteArray(gfc.length);
   return ok && !fake_gfs.errors;
 }
@@ -768,13 +760,12 @@ read_gif(Gif_Reader *grr, int read_flags,
   gfi = Gif_NewImage();
 
   gfc.stream = gfs;
-  gfc.prefix = Gif_NewArray(Gif_Code, GIF_MAX_CODE);
-  gfc.suffix = Gif_NewArray(uint8_t, GIF_MAX_CODE);
+  gfc.offset = Gif_NewArray(uint32_t, GIF_MAX_CODE);
   gfc.length = Gif_NewArray(uint16_t, GIF_MAX_CODE);
   gfc.handler = handler;
   gfc.handler_thunk = handler_thunk;
 
-  if (!gfs || !gfi || !gfc.prefix || !gfc.suffix || !gfc.length)
+  if (!gfs || !gfi || !gfc.offset || !gfc.length)
     goto done;
 
   GIF_DEBUG(("\nGIF"));
@@ -861,8 +852,7 @@ read_gif(Gif_Reader *grr, int read_flags,
 
   Gif_DeleteImage(gfi);
   Gif_DeleteArray(last_name);
-  Gif_DeleteArray(gfc.prefix);
-  Gif_DeleteArray(gfc.suffix);
+  Gif_DeleteArray(gfc.offset);
   Gif_DeleteArray(gfc.length);
 
   if (gfs && gfs->errors == 0 && !(read_flags & GIF_READ_TRAILING_GARBAGE_OK) && !grr->eofer(grr)) {
@@ -9,6 +9,7 @@
 #include <ctype.h>
 #include <string.h>
 #include <errno.h>
+#include <lcdfgif/gif.h>
 
 int is_static = 1;
 int is_const = 1;
@@ -125,10 +126,102 @@ print_unreckless(FILE *f, char *gifrecname)
 	 gifrecname, gifrecname, size);
 }
 
+static void
+print_array(const char *name, const unsigned char *data, unsigned long size)
+{
+  unsigned long i;
+  printf("\nstatic %sunsigned char %s[] = {",
+	 (is_const ? "const " : ""), name);
+  for (i = 0; i < size; i++) {
+    if (i % 20 == 0) printf("\n");
+    printf("%d,", data[i]);
+  }
+  printf("};\n");
+}
+
+static void
+print_colormap(const char *name, const Gif_Colormap *gfcm)
+{
+  unsigned char *rgb = (unsigned char *)fmalloc(gfcm->ncol * 3);
+  int i;
+  for (i = 0; i < gfcm->ncol; i++) {
+    rgb[3*i] = gfcm->col[i].red;
+    rgb[3*i + 1] = gfcm->col[i].green;
+    rgb[3*i + 2] = gfcm->col[i].blue;
+  }
+  print_array(name, rgb, gfcm->ncol * 3);
+  free(rgb);
+}
+
+/* Decode the GIF now, so the program using it needn't. */
+static void
+print_decoded(FILE *f, const char *file_name, char *gifrecname)
+{
+  Gif_Stream *gfs = Gif_FullReadFile(f, GIF_READ_UNCOMPRESSED, 0, 0);
+  char *name;
+  int i, y;
+
+  if (!gfs || gfs->errors) {
+    fprintf(stderr, "%s: not a GIF\n", file_name);
+    exit(1);
+  }
+  name = (char *)fmalloc(strlen(gifrecname) + 20);
+
+  if (gfs->global) {
+    sprintf(name, "%s_global", gifrecname);
+    print_colormap(name, gfs->global);
+  }
+
+  for (i = 0; i < gfs->nimages; i++) {
+    Gif_Image *gfi = gfs->images[i];
+    unsigned char *data = (unsigned char *)fmalloc(gfi->width * gfi->height);
+    if (gfi->local) {
+      sprintf(name, "%s_local%d", gifrecname, i);
+      print_colormap(name, gfi->local);
+    }
+    /* write rows in order, whether or not the image was interlaced */
+    for (y = 0; y < gfi->height; y++)
+      memcpy(data + y * gfi->width, gfi->img[y], gfi->width);
+    sprintf(name, "%s_image%d", gifrecname, i);
+    print_array(name, data, gfi->width * gfi->height);
+    free(data);
+  }
+
+  printf("\nstatic %sGif_DecodedImage %s_images[] = {\n",
+	 (is_const ? "const " : ""), gifrecname);
+  for (i = 0; i < gfs->nimages; i++) {
+    Gif_Image *gfi = gfs->images[i];
+    printf("  { %d, %d, %d, %d, %d, %d, %d, ", gfi->left, gfi->top,
+	   gfi->width, gfi->height, gfi->delay, gfi->disposal,
+	   gfi->transparent);
+    if (gfi->local)
+      printf("%d, %s_local%d, ", gfi->local->ncol, gifrecname, i);
+    else
+      printf("0, 0, ");
+    printf("%s_image%d },\n", gifrecname, i);
+  }
+  printf("};\n");
+
+  printf("%s%sGif_DecodedRecord %s = { %d, %d, %ld, %d, ",
+	 (is_static ? "static " : ""),
+	 (is_const ? "const " : ""),
+	 gifrecname, gfs->screen_width, gfs->screen_height, gfs->loopcount,
+	 gfs->background);
+  if (gfs->global)
+    printf("%d, %s_global, ", gfs->global->ncol, gifrecname);
+  else
+    printf("0, 0, ");
+  printf("%d, %s_images };\n", gfs->nimages, gifrecname);
+
+  free(name);
+  Gif_DeleteStream(gfs);
+}
+
 int
 main(int argc, char *argv[])
 {
   int reckless = 0;
+  int decoded = 0;
   int make_name = 0;
   const char *directory = "";
 
@@ -137,6 +230,8 @@ main(int argc, char *argv[])
   while (argv[0] && argv[0][0] == '-') {
     if (!strcmp(argv[0], "-reckless"))
       reckless = 1, argc--, argv++;
+    else if (!strcmp(argv[0], "-decoded"))
+      decoded = 1, argc--, argv++;
     else if (!strcmp(argv[0], "-static"))
       is_static = 1, argc--, argv++;
     else if (!strcmp(argv[0], "-extern"))
@@ -166,7 +261,7 @@ main(int argc, char *argv[])
     fprintf(stderr, "\
 usage: giftoc [OPTIONS] FILE NAME [FILE NAME...]\n\
 or:    giftoc -makename [OPTIONS] FILE [FILE...]\n\
-       OPTIONS are -reckless, -extern, -nonconst, -dir DIR\n");
+       OPTIONS are -reckless, -decoded, -extern, -nonconst, -dir DIR\n");
     exit(1);
   }
 
@@ -205,7 +300,8 @@ or:    giftoc -makename [OPTIONS] FILE [FILE...]\n\
       rec_name = argv[0];
     }
 
-    if (reckless) print_reckless(f, rec_name);
+    if (decoded) print_decoded(f, file_name, rec_name);
+    else if (reckless) print_reckless(f, rec_name);
     else print_unreckless(f, rec_name);
 
    done:
@@ -14,6 +14,14 @@
 #include <X11/Xutil.h>
 #include <assert.h>
 #include <string.h>
+#ifdef HAVE_XSHM
+# include <sys/ipc.h>
+# include <sys/shm.h>
+# include <X11/extensions/XShm.h>
+#endif
+#ifdef HAVE_XRENDER
+# include <X11/extensions/Xrender.h>
+#endif
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -37,6 +45,27 @@ struct Gif_XColormap {
 static unsigned long crap_pixels[256];
 
 
+/* Colors that can't be allocated exactly get the closest color already in
+   the colormap. gfx->closest holds the colormap's colors sorted by red, so a
+   search can stop once the red difference alone exceeds the best distance.
+   Results are remembered in a small direct-mapped RGB -> index cache shared
+   by all of the context's colormaps; it is cleared whenever gfx->closest
+   changes. */
+
+struct Gif_XClosestEntry {
+  uint32_t rgb;			/* 0x1RRGGBB, or 0 if empty */
+  uint16_t index;		/* into gfx->closest */
+};
+
+#define CLOSEST_CACHE_SIZE	1024
+
+static int
+compare_closest_red(const void *va, const void *vb)
+{
+  const Gif_Color *a = (const Gif_Color *)va, *b = (const Gif_Color *)vb;
+  return a->red - b->red;
+}
+
 static void
 load_closest(Gif_XContext *gfx)
 {
@@ -69,33 +98,80 @@ load_closest(Gif_XContext *gfx)
     c->pixel = color[i].pixel;
   }
   gfx->nclosest = ncolor;
+  qsort(gfx->closest, ncolor, sizeof(Gif_Color), compare_closest_red);
+
+  if (!gfx->closest_cache)
+    gfx->closest_cache = Gif_NewArray(Gif_XClosestEntry, CLOSEST_CACHE_SIZE);
+  memset(gfx->closest_cache, 0, sizeof(Gif_XClosestEntry) * CLOSEST_CACHE_SIZE);
 
   Gif_DeleteArray(color);
 }
 
+static void
+release_closest(Gif_XContext *gfx)
+{
+  Gif_DeleteArray(gfx->closest);
+  gfx->closest = 0;
+  gfx->nclosest = 0;
+  /* keep closest_cache; load_closest() clears it for reuse */
+}
 
-static unsigned long
-allocate_closest(Gif_XContext *gfx, Gif_Color *c)
+static int
+find_closest(Gif_XContext *gfx, const Gif_Color *c)
 {
-  Gif_Color *closer;
-  Gif_Color *got = 0;
+  const Gif_Color *closest = gfx->closest;
+  int n = gfx->nclosest;
+  int lo = 0, hi = n, up, down, got = -1;
   uint32_t distance = 0x4000000;
-  int i;
 
-  load_closest(gfx);
+  /* start at the first color with red >= c->red and work outwards */
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (closest[mid].red < c->red)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
 
-  for (i = 0, closer = gfx->closest; i < gfx->nclosest; i++, closer++) {
-    int redd = c->red - closer->red;
-    int greend = c->green - closer->green;
-    int blued = c->blue - closer->blue;
-    uint32_t d = redd * redd + greend * greend + blued * blued;
+  for (up = lo, down = lo - 1; up < n || down >= 0; ) {
+    int i, redd, greend, blued;
+    uint32_t d;
+    if (up < n && (down < 0 || closest[up].red - c->red <= c->red - closest[down].red))
+      i = up++;
+    else
+      i = down--;
+    redd = c->red - closest[i].red;
+    if ((uint32_t) (redd * redd) >= distance)
+      break;
+    greend = c->green - closest[i].green;
+    blued = c->blue - closest[i].blue;
+    d = redd * redd + greend * greend + blued * blued;
     if (d < distance) {
       distance = d;
-      got = closer;
+      got = i;
     }
   }
 
-  if (!got) return 0;
+  return got;
+}
+
+static unsigned long
+allocate_closest(Gif_XContext *gfx, Gif_Color *c)
+{
+  Gif_XClosestEntry *e;
+  Gif_Color *got;
+  uint32_t rgb = 0x1000000 | (c->red << 16) | (c->green << 8) | c->blue;
+
+  load_closest(gfx);
+  if (!gfx->nclosest) return 0;
+
+  e = &gfx->closest_cache[(rgb * 0x9E3779B1U) >> 22];
+  if (e->rgb != rgb) {
+    e->rgb = rgb;
+    e->index = find_closest(gfx, c);
+  }
+  got = &gfx->closest[e->index];
+
   if (!got->haspixel) {
     XColor xcol;
     xcol.red = got->red | (got->red << 8);
@@ -103,8 +179,11 @@ allocate_closest(Gif_XContext *gfx, Gif_Color *c)
     xcol.blue = got->blue | (got->blue << 8);
     if (XAllocColor(gfx->display, gfx->colormap, &xcol) == 0) {
       /* Probably was a read/write color cell. Get rid of it!! */
-      *got = gfx->closest[gfx->nclosest - 1];
       gfx->nclosest--;
+      memmove(got, got + 1,
+	      sizeof(Gif_Color) * (gfx->closest + gfx->nclosest - got));
+      memset(gfx->closest_cache, 0,
+	     sizeof(Gif_XClosestEntry) * CLOSEST_CACHE_SIZE);
       return allocate_closest(gfx, c);
     }
     got->pixel = xcol.pixel;
@@ -147,6 +226,8 @@ deallocate_colors(Gif_XColormap *gfxc)
   if (gfxc->allocated && !gfxc->claimed) {
     XFreeColors(gfx->display, gfx->colormap, gfxc->pixels, gfxc->npixels, 0);
     gfxc->allocated = 0;
+    /* freed cells may be reused for other colors: reread the colormap */
+    release_closest(gfx);
   }
 }
 
@@ -259,16 +340,231 @@ Gif_XClaimStreamColors(Gif_XContext *gfx, Gif_Stream *gfs, int *np_store)
 
 #define BYTESIZE 8
 
+#ifdef HAVE_XSHM
+
+/* MIT-SHM. Large images reach a local server through one reusable shared
+   memory segment instead of the X socket. The server may still be reading
+   the segment after XShmPutImage returns, so we XSync before reusing it. */
+
+struct Gif_XShm {
+  XShmSegmentInfo info;
+  unsigned size;
+  int busy;
+};
+
+#define GIFX_SHM_MIN_SIZE	16384
+
+static int shm_error;
+
+static int
+shm_error_handler(Display *display, XErrorEvent *error)
+{
+  (void) display, (void) error;
+  shm_error = 1;
+  return 0;
+}
+
+static void
+release_shm(Gif_XContext *gfx)
+{
+  Gif_XShm *shm = gfx->shm;
+  if (shm) {
+    XShmDetach(gfx->display, &shm->info);
+    XSync(gfx->display, False);
+    shmdt(shm->info.shmaddr);
+    Gif_Delete(shm);
+    gfx->shm = 0;
+  }
+}
+
+static Gif_XShm *
+get_shm(Gif_XContext *gfx, unsigned size)
+{
+  Gif_XShm *shm = gfx->shm;
+  XErrorHandler old_handler;
+
+  if (shm && shm->size >= size) {
+    if (shm->busy)
+      XSync(gfx->display, False);
+    shm->busy = 0;
+    return shm;
+  }
+  release_shm(gfx);
+
+  if (!XShmQueryExtension(gfx->display))
+    goto disable;
+
+  shm = Gif_New(Gif_XShm);
+  shm->size = size;
+  shm->busy = 0;
+  shm->info.readOnly = True;
+  shm->info.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+  if (shm->info.shmid < 0)
+    goto error;
+  shm->info.shmaddr = (char *)shmat(shm->info.shmid, 0, 0);
+  if (shm->info.shmaddr == (char *)-1) {
+    shmctl(shm->info.shmid, IPC_RMID, 0);
+    goto error;
+  }
+
+  /* A remote server can't attach the segment. Find out without dying, and
+     without hiding errors from earlier requests. */
+  XSync(gfx->display, False);
+  shm_error = 0;
+  old_handler = XSetErrorHandler(shm_error_handler);
+  XShmAttach(gfx->display, &shm->info);
+  XSync(gfx->display, False);
+  XSetErrorHandler(old_handler);
+  /* the segment goes away once both sides detach */
+  shmctl(shm->info.shmid, IPC_RMID, 0);
+  if (shm_error) {
+    shmdt(shm->info.shmaddr);
+    goto error;
+  }
+
+  gfx->shm = shm;
+  gfx->shm_state = 1;
+  return shm;
+
+ error:
+  Gif_Delete(shm);
+ disable:
+  gfx->shm_state = -1;
+  return 0;
+}
+
+#endif
+
+/* Pixel kernels for ZPixmaps whose pixels are whole bytes. The palette holds
+   each pixel value as LSBFirst bytes, with out-of-range color indexes already
+   mapped to pixel 0, so each pixel is one table lookup and one small
+   fixed-size copy the compiler turns into a single store. */
+
+typedef uint8_t Gif_XPixelBytes[4];
+typedef void (*put_line_func)(uint8_t *, const uint8_t *, int,
+			      const Gif_XPixelBytes *);
+
+static void
+put_line_8(uint8_t *writer, const uint8_t *line, int width,
+	   const Gif_XPixelBytes *palette)
+{
+  int i;
+  for (i = 0; i < width; i++)
+    writer[i] = palette[line[i]][0];
+}
+
+static void
+put_line_16(uint8_t *writer, const uint8_t *line, int width,
+	    const Gif_XPixelBytes *palette)
+{
+  int i;
+  for (i = 0; i < width; i++, writer += 2)
+    memcpy(writer, palette[line[i]], 2);
+}
+
+static void
+put_line_24(uint8_t *writer, const uint8_t *line, int width,
+	    const Gif_XPixelBytes *palette)
+{
+  int i;
+  for (i = 0; i < width; i++, writer += 3)
+    memcpy(writer, palette[line[i]], 3);
+}
+
+static void
+put_line_32(uint8_t *writer, const uint8_t *line, int width,
+	    const Gif_XPixelBytes *palette)
+{
+  int i;
+  for (i = 0; i < width; i++, writer += 4)
+    memcpy(writer, palette[line[i]], 4);
+}
+
+static put_line_func
+choose_put_line(int bits_per_pixel)
+{
+  switch (bits_per_pixel) {
+   case 8: return put_line_8;
+   case 16: return put_line_16;
+   case 24: return put_line_24;
+   case 32: return put_line_32;
+   default: return 0;
+  }
+}
+
+/* Transparency masks. Transparent pixels get 0 bits: the mask GC's
+   foreground is 0 and its background 1, so XPutImage of the XYBitmap
+   inverts them. */
+
+static XImage *
+new_mask_ximage(Gif_XContext *gfx, int width, int height)
+{
+  XImage *ximage =
+    XCreateImage(gfx->display, gfx->visual, 1,
+		 XYBitmap, 0, NULL,
+		 width, height,
+		 8, 0);
+  ximage->bitmap_bit_order = ximage->byte_order = LSBFirst;
+  ximage->data = (char *)Gif_NewArray(uint8_t, ximage->bytes_per_line * height);
+  return ximage;
+}
+
+static void
+put_mask_line(uint8_t *writer, const uint8_t *line, int width, int transparent)
+{
+  int i, imshift = 0;
+  uint32_t impixel = 0;
+
+  for (i = 0; i < width; i++) {
+    if (line[i] == transparent)
+      impixel |= 1 << imshift;
+
+    if (++imshift >= BYTESIZE) {
+      *writer++ = impixel;
+      imshift = 0;
+      impixel = 0;
+    }
+  }
+
+  if (imshift)
+    *writer++ = impixel;
+}
+
+static Pixmap
+mask_ximage_pixmap(Gif_XContext *gfx, XImage *ximage)
+{
+  Pixmap pixmap =
+    XCreatePixmap(gfx->display, gfx->drawable, ximage->width, ximage->height, 1);
+  if (!gfx->mask_gc)
+    gfx->mask_gc = XCreateGC(gfx->display, pixmap, 0, 0);
+
+  if (pixmap && gfx->mask_gc)
+    XPutImage(gfx->display, pixmap, gfx->mask_gc, ximage, 0, 0, 0, 0,
+	      ximage->width, ximage->height);
+
+  Gif_DeleteArray(ximage->data);
+  ximage->data = 0; /* avoid freeing it again in XDestroyImage */
+  XDestroyImage(ximage);
+  return pixmap;
+}
+
+/* If mask is nonnull, also fill it with the transparency mask, in the same
+   pass over the image rows. */
 static int
 put_sub_image_colormap(Gif_XContext *gfx, Gif_Image *gfi, Gif_Colormap *gfcm,
 		       int left, int top, int width, int height,
-		       Pixmap pixmap, int pixmap_x, int pixmap_y)
+		       Pixmap pixmap, int pixmap_x, int pixmap_y,
+		       XImage *mask)
 {
-  XImage *ximage;
+  XImage *ximage = 0;
   uint8_t *xdata;
+#ifdef HAVE_XSHM
+  Gif_XShm *shm = 0;
+#endif
 
   int i, j, k;
   int bytes_per_line;
+  put_line_func put_line;
 
   unsigned long saved_transparent = 0;
   int release_uncompressed = 0;
@@ -313,6 +609,26 @@ put_sub_image_colormap(Gif_XContext *gfx, Gif_Image *gfi, Gif_Colormap *gfcm,
   }
 
   /* Set up the X image */
+#ifdef HAVE_XSHM
+  /* Shared images must be in the server's byte order; we write LSBFirst */
+  if (gfx->shm_state >= 0 && gfx->depth > 1
+      && ImageByteOrder(gfx->display) == LSBFirst
+      && BitmapBitOrder(gfx->display) == LSBFirst) {
+    ximage = XShmCreateImage(gfx->display, gfx->visual, gfx->depth, ZPixmap,
+			     NULL, NULL, width, height);
+    if (ximage && (unsigned) (ximage->bytes_per_line * height)
+	>= GIFX_SHM_MIN_SIZE)
+      shm = get_shm(gfx, ximage->bytes_per_line * height);
+    if (shm) {
+      ximage->data = shm->info.shmaddr;
+      ximage->obdata = (char *)&shm->info;
+    } else if (ximage) {
+      XDestroyImage(ximage);
+      ximage = 0;
+    }
+  }
+  if (!ximage) {
+#endif
   if (gfx->depth <= 8) i = 8;
   else if (gfx->depth <= 16) i = 16;
   else i = 32;
@@ -320,31 +636,33 @@ put_sub_image_colormap(Gif_XContext *gfx, Gif_Image *gfi, Gif_Colormap *gfcm,
     XCreateImage(gfx->display, gfx->visual, gfx->depth,
 		 gfx->depth == 1 ? XYBitmap : ZPixmap, 0, NULL,
 		 width, height, i, 0);
+  ximage->data = (char *)Gif_NewArray(uint8_t, ximage->bytes_per_line * height);
+#ifdef HAVE_XSHM
+  }
+#endif
 
   ximage->bitmap_bit_order = ximage->byte_order = LSBFirst;
   bytes_per_line = ximage->bytes_per_line;
-  xdata = Gif_NewArray(uint8_t, bytes_per_line * height);
-  ximage->data = (char *)xdata;
+  xdata = (uint8_t *)ximage->data;
 
   /* The main loop */
-  if (ximage->bits_per_pixel % 8 == 0) {
+  if ((put_line = choose_put_line(ximage->bits_per_pixel))) {
     /* Optimize for cases where a pixel is exactly one or more bytes */
-    int bytes_per_pixel = ximage->bits_per_pixel / 8;
+    Gif_XPixelBytes palette[256];
+    for (i = 0; i < 256; i++) {
+      unsigned long pixel = (i < nct ? pixels[i] : pixels[0]);
+      for (k = 0; k < 4; k++) {
+	palette[i][k] = pixel;
+	pixel >>= 8;
+      }
+    }
 
     for (j = 0; j < height; j++) {
-      uint8_t *line = gfi->img[top + j] + left;
-      uint8_t *writer = xdata + bytes_per_line * j;
-      for (i = 0; i < width; i++) {
-	unsigned long pixel;
-	if (line[i] < nct)
-	  pixel = pixels[line[i]];
-	else
-	  pixel = pixels[0];
-	for (k = 0; k < bytes_per_pixel; k++) {
-	  *writer++ = pixel;
-	  pixel >>= 8;
-	}
-      }
+      put_line(xdata + bytes_per_line * j, gfi->img[top + j] + left, width,
+	       (const Gif_XPixelBytes *) palette);
+      if (mask)
+	put_mask_line((uint8_t *)mask->data + mask->bytes_per_line * j,
+		      gfi->img[top + j] + left, width, gfi->transparent);
     }
 
   } else {
@@ -376,6 +694,10 @@ put_sub_image_colormap(Gif_XContext *gfx, Gif_Image *gfi, Gif_Colormap *gfcm,
 
       if (imshift)
 	*writer++ = impixel;
+
+      if (mask)
+	put_mask_line((uint8_t *)mask->data + mask->bytes_per_line * j,
+		      line, width, gfi->transparent);
     }
   }
 
@@ -384,10 +706,20 @@ put_sub_image_colormap(Gif_XContext *gfx, Gif_Image *gfi, Gif_Colormap *gfcm,
     pixels[ gfi->transparent ] = saved_transparent;
 
   /* Put it onto the pixmap */
-  XPutImage(gfx->display, pixmap, gfx->image_gc, ximage, 0, 0,
-	    pixmap_x, pixmap_y, width, height);
+#ifdef HAVE_XSHM
+  if (shm) {
+    XShmPutImage(gfx->display, pixmap, gfx->image_gc, ximage, 0, 0,
+		 pixmap_x, pixmap_y, width, height, False);
+    shm->busy = 1;
+    ximage->obdata = 0;
+  } else
+#endif
+  {
+    XPutImage(gfx->display, pixmap, gfx->image_gc, ximage, 0, 0,
+	      pixmap_x, pixmap_y, width, height);
+    Gif_DeleteArray(xdata);
+  }
 
-  Gif_DeleteArray(xdata);
   ximage->data = 0; /* avoid freeing it again in XDestroyImage */
   XDestroyImage(ximage);
 
@@ -406,7 +738,7 @@ Gif_XSubImageColormap(Gif_XContext *gfx, Gif_Image *gfi, Gif_Colormap *gfcm,
     XCreatePixmap(gfx->display, gfx->drawable, width, height, gfx->depth);
   if (pixmap) {
     if (put_sub_image_colormap(gfx, gfi, gfcm, left, top, width, height,
-			       pixmap, 0, 0))
+			       pixmap, 0, 0, 0))
       return pixmap;
     else
       XFreePixmap(gfx->display, pixmap);
@@ -456,11 +788,8 @@ Gif_XSubMask(Gif_XContext *gfx, Gif_Image *gfi,
 {
   Pixmap pixmap = None;
   XImage *ximage;
-  uint8_t *xdata;
 
-  int i, j;
-  int transparent;
-  int bytes_per_line;
+  int j;
   int release_uncompressed = 0;
 
   /* Find the correct image */
@@ -479,54 +808,15 @@ Gif_XSubMask(Gif_XContext *gfx, Gif_Image *gfi,
   }
 
   /* Create the X image */
-  ximage =
-    XCreateImage(gfx->display, gfx->visual, 1,
-		 XYBitmap, 0, NULL,
-		 width, height,
-		 8, 0);
-
-  ximage->bitmap_bit_order = ximage->byte_order = LSBFirst;
-  bytes_per_line = ximage->bytes_per_line;
-  xdata = Gif_NewArray(uint8_t, bytes_per_line * height);
-  ximage->data = (char *)xdata;
-
-  transparent = gfi->transparent;
+  ximage = new_mask_ximage(gfx, width, height);
 
   /* The main loop */
-  for (j = 0; j < height; j++) {
-    int imshift = 0;
-    uint32_t impixel = 0;
-    uint8_t *line = gfi->img[top + j] + left;
-    uint8_t *writer = xdata + bytes_per_line * j;
-
-    for (i = 0; i < width; i++) {
-      if (line[i] == transparent)
-	impixel |= 1 << imshift;
-
-      if (++imshift >= BYTESIZE) {
-	*writer++ = impixel;
-	imshift = 0;
-	impixel = 0;
-      }
-    }
-
-    if (imshift)
-      *writer++ = impixel;
-  }
+  for (j = 0; j < height; j++)
+    put_mask_line((uint8_t *)ximage->data + ximage->bytes_per_line * j,
+		  gfi->img[top + j] + left, width, gfi->transparent);
 
   /* Create the pixmap */
-  pixmap =
-    XCreatePixmap(gfx->display, gfx->drawable, width, height, 1);
-  if (!gfx->mask_gc)
-    gfx->mask_gc = XCreateGC(gfx->display, pixmap, 0, 0);
-
-  if (pixmap && gfx->mask_gc)
-    XPutImage(gfx->display, pixmap, gfx->mask_gc, ximage, 0, 0, 0, 0,
-	      width, height);
-
-  Gif_DeleteArray(xdata);
-  ximage->data = 0; /* avoid freeing it again in XDestroyImage */
-  XDestroyImage(ximage);
+  pixmap = mask_ximage_pixmap(gfx, ximage);
 
   if (release_uncompressed)
     Gif_ReleaseUncompressedImage(gfi);
@@ -598,15 +888,130 @@ apply_background(Gif_XContext *gfx, Gif_Stream *gfs, int i, Pixmap pixmap)
   return 0;
 }
 
+#ifdef HAVE_XRENDER
+
+#if defined(__cplusplus) || defined(c_plusplus)
+#define VISUAL_CLASS c_class
+#else
+#define VISUAL_CLASS class
+#endif
+
+/* With XRender, a transparent image goes up as one ARGB picture, with
+   transparency in its alpha channel, and is composited straight onto the
+   frame: no separate mask pass, mask pixmap, or clip-masked copy. Only on
+   TrueColor visuals, where composited colors match allocated ones. */
+
+static int
+apply_image_render(Gif_XContext *gfx, Gif_Image *gfi, Gif_Colormap *gfcm,
+		   Pixmap pixmap)
+{
+  Display *display = gfx->display;
+  XRenderPictFormat *dst_format, *argb_format;
+  XImage *ximage;
+  Pixmap argb;
+  Picture src, dst;
+  Gif_XPixelBytes palette[256];
+  int i, j, release_uncompressed = 0;
+
+  if (gfx->render_state == 0) {
+    int event_base, error_base;
+    gfx->render_state = -1;
+    if (gfx->visual->VISUAL_CLASS == TrueColor
+	&& XRenderQueryExtension(display, &event_base, &error_base))
+      gfx->render_state = 1;
+  }
+  if (gfx->render_state < 0)
+    return -1;
+
+  dst_format = XRenderFindVisualFormat(display, gfx->visual);
+  argb_format = XRenderFindStandardFormat(display, PictStandardARGB32);
+  if (!dst_format || !argb_format)
+    return -1;
+
+  if (!gfi->img && !gfi->image_data && gfi->compressed) {
+    Gif_UncompressImage(gfi);
+    release_uncompressed = 1;
+  }
+  if (!gfi->img)
+    return -1;
+
+  /* premultiplied ARGB in LSBFirst byte order; transparent is all zeros */
+  for (i = 0; i < 256; i++) {
+    Gif_Color *c = &gfcm->col[i < gfcm->ncol ? i : 0];
+    palette[i][0] = c->blue;
+    palette[i][1] = c->green;
+    palette[i][2] = c->red;
+    palette[i][3] = 0xFF;
+  }
+  if (gfi->transparent < 256)
+    memset(palette[gfi->transparent], 0, 4);
+
+  ximage = XCreateImage(display, gfx->visual, 32, ZPixmap, 0, NULL,
+			gfi->width, gfi->height, 32, 0);
+  ximage->bitmap_bit_order = ximage->byte_order = LSBFirst;
+  ximage->data = (char *)Gif_NewArray(uint8_t,
+				      ximage->bytes_per_line * gfi->height);
+  for (j = 0; j < gfi->height; j++)
+    put_line_32((uint8_t *)ximage->data + ximage->bytes_per_line * j,
+		gfi->img[j], gfi->width, (const Gif_XPixelBytes *) palette);
+
+  argb = XCreatePixmap(display, gfx->drawable, gfi->width, gfi->height, 32);
+  if (!gfx->argb_gc)
+    gfx->argb_gc = XCreateGC(display, argb, 0, 0);
+  XPutImage(display, argb, gfx->argb_gc, ximage, 0, 0, 0, 0,
+	    gfi->width, gfi->height);
+  Gif_DeleteArray(ximage->data);
+  ximage->data = 0; /* avoid freeing it again in XDestroyImage */
+  XDestroyImage(ximage);
+
+  src = XRenderCreatePicture(display, argb, argb_format, 0, 0);
+  dst = XRenderCreatePicture(display, pixmap, dst_format, 0, 0);
+  XRenderComposite(display, PictOpOver, src, None, dst, 0, 0, 0, 0,
+		   gfi->left, gfi->top, gfi->width, gfi->height);
+  XRenderFreePicture(display, src);
+  XRenderFreePicture(display, dst);
+  XFreePixmap(display, argb);
+
+  if (release_uncompressed)
+    Gif_ReleaseUncompressedImage(gfi);
+  return 0;
+}
+
+#endif
+
 static int
 apply_image(Gif_XContext *gfx, Gif_Stream *gfs, Gif_Image *gfi, Pixmap pixmap)
 {
-  Pixmap image = Gif_XImage(gfx, gfs, gfi), mask;
+  Gif_Colormap *gfcm = (gfi->local ? gfi->local : gfs->global);
+  XImage *mask_ximage = 0;
+  Pixmap image, mask;
+
+#ifdef HAVE_XRENDER
+  if (gfi->transparent >= 0 && gfcm
+      && apply_image_render(gfx, gfi, gfcm, pixmap) >= 0)
+    return 0;
+#endif
+
+  /* render the image and its mask in one pass */
+  image = XCreatePixmap(gfx->display, gfx->drawable, gfi->width, gfi->height,
+			gfx->depth);
   if (image == None)
     return -1;
+  if (gfi->transparent >= 0)
+    mask_ximage = new_mask_ximage(gfx, gfi->width, gfi->height);
+  if (!put_sub_image_colormap(gfx, gfi, gfcm, 0, 0, gfi->width, gfi->height,
+			      image, 0, 0, mask_ximage)) {
+    if (mask_ximage) {
+      Gif_DeleteArray(mask_ximage->data);
+      mask_ximage->data = 0;
+      XDestroyImage(mask_ximage);
+    }
+    XFreePixmap(gfx->display, image);
+    return -1;
+  }
 
-  if (gfi->transparent >= 0) {
-    mask = Gif_XMask(gfx, gfs, gfi);
+  if (mask_ximage) {
+    mask = mask_ximage_pixmap(gfx, mask_ximage);
     if (mask == None) {
       XFreePixmap(gfx->display, image);
       return -1;
@@ -811,6 +1216,11 @@ Gif_NewXContextFromVisual(Display *display, int screen_number,
   gfx->foreground_pixel = 1UL;
   gfx->refcount = 0;
 
+  gfx->shm_state = 0;
+  gfx->shm = 0;
+  gfx->render_state = 0;
+  gfx->argb_gc = None;
+
   Gif_AddDeletionHook(GIF_T_COLORMAP, delete_colormap_hook, gfx);
   return gfx;
 }
@@ -837,7 +1247,13 @@ Gif_DeleteXContext(Gif_XContext *gfx)
     XFreeGC(gfx->display, gfx->image_gc);
   if (gfx->mask_gc)
     XFreeGC(gfx->display, gfx->mask_gc);
+  if (gfx->argb_gc)
+    XFreeGC(gfx->display, gfx->argb_gc);
+#ifdef HAVE_XSHM
+  release_shm(gfx);
+#endif
   Gif_DeleteArray(gfx->closest);
+  Gif_DeleteArray(gfx->closest_cache);
   Gif_Delete(gfx);
   Gif_RemoveDeletionHook(GIF_T_COLORMAP, delete_colormap_hook, gfx);
 }
@@ -14,7 +14,67 @@
 # include <sys/utsname.h>
 #endif
 
-#define NEW_HAND_TRIES 6
+/* index of hands by window, so event dispatch need not walk hand lists */
+
+static Hand **hand_index;
+static unsigned hand_index_size;	/* a power of two, or 0 */
+static unsigned hand_index_count;
+
+#define HAND_INDEX_BUCKET(w)	((((w) >> 10) ^ (w)) & (hand_index_size - 1))
+
+static void
+index_hand(Hand *h)
+{
+  unsigned i;
+  if (hand_index_count >= hand_index_size) {
+    /* grow and rehash */
+    Hand **old = hand_index;
+    unsigned old_size = hand_index_size;
+    hand_index_size = (old_size ? old_size * 2 : 32);
+    hand_index = xwNEWARR(Hand *, hand_index_size);
+    memset(hand_index, 0, sizeof(Hand *) * hand_index_size);
+    for (i = 0; i < old_size; i++)
+      while (old[i]) {
+	Hand *x = old[i];
+	unsigned b = HAND_INDEX_BUCKET(x->w);
+	old[i] = x->hash_next;
+	x->hash_next = hand_index[b];
+	hand_index[b] = x;
+      }
+    xfree(old);
+  }
+  i = HAND_INDEX_BUCKET(h->w);
+  h->hash_next = hand_index[i];
+  hand_index[i] = h;
+  hand_index_count++;
+}
+
+static void
+unindex_hand(Hand *h)
+{
+  Hand **pp = &hand_index[HAND_INDEX_BUCKET(h->w)];
+  for (; *pp; pp = &(*pp)->hash_next)
+    if (*pp == h) {
+      *pp = h->hash_next;
+      hand_index_count--;
+      return;
+    }
+}
+
+/* find the hand, main or icon, for a window on any port */
+
+Hand *
+display_window_to_hand(Display *display, Window w)
+{
+  Hand *h;
+  if (!hand_index_size)
+    return 0;
+  for (h = hand_index[HAND_INDEX_BUCKET(w)]; h; h = h->hash_next)
+    if (h->w == w && h->port->display == display)
+      return h;
+  return 0;
+}
+
 
 /* creating a new hand */
 
@@ -41,35 +101,184 @@ get_icon_size(Port *port)
 #define xwMAX(i, j) ((i) > (j) ? (i) : (j))
 #define xwMIN(i, j) ((i) < (j) ? (i) : (j))
 
-/* get_best_position: gets the best (x, y) pair from the list of pairs stored
-     in xlist and ylist (num pairs overall). Best means 'covering smallest
-     number of existing hands.' Returns it in *retx and *rety */
+/* Placing new hands. Each master Port keeps a grid over its screen counting
+   how many mapped hands cover each PLACE_CELL x PLACE_CELL cell, updated as
+   hands map, move, and unmap. To place a hand, a summed-area table over the
+   grid gives the overlap of any candidate rectangle in constant time, so
+   every cell-spaced position in the allowed area is scored in one pass. */
+
+#define PLACE_CELL 16
 
 static void
-get_best_position(Port *port, int *xlist, int *ylist, int num,
-		  int width, int height, int *retx, int *rety)
+init_occupancy(Port *port)
 {
-  unsigned int best_penalty = 0x8000U;
-  unsigned int penalty;
-  int i, overw, overh, best = 0;
-  Hand *h;
-  for (i = 0; i < num; i++) {
-    int x1 = xlist[i], y1 = ylist[i];
-    int x2 = x1 + width, y2 = y1 + height;
-    penalty = 0;
-    for (h = port->hands; h; h = h->next)
-      if (h->mapped) {
-	overw = xwMIN(x2, h->x + h->width) - xwMAX(x1, h->x);
-	overh = xwMIN(y2, h->y + h->height) - xwMAX(y1, h->y);
-	if (overw > 0 && overh > 0) penalty += overw * overh;
-      }
-    if (penalty < best_penalty) {
-      best_penalty = penalty;
-      best = i;
+  Screen *screen = ScreenOfDisplay(port->display, port->screen_number);
+  int n;
+  port->occupancy_w = (WidthOfScreen(screen) + PLACE_CELL - 1) / PLACE_CELL;
+  port->occupancy_h = (HeightOfScreen(screen) + PLACE_CELL - 1) / PLACE_CELL;
+  n = port->occupancy_w * port->occupancy_h;
+  port->occupancy = xwNEWARR(unsigned short, n);
+  memset(port->occupancy, 0, sizeof(unsigned short) * n);
+  n = (port->occupancy_w + 1) * (port->occupancy_h + 1);
+  port->occupancy_sat = xwNEWARR(unsigned, n);
+  memset(port->occupancy_sat, 0, sizeof(unsigned) * n);
+  port->occupancy_dirty = 0;
+}
+
+static void
+occupy(Port *port, Hand *h, int delta)
+{
+  int x, y;
+  for (y = h->occupy_y0; y < h->occupy_y1; y++) {
+    unsigned short *row = port->occupancy + y * port->occupancy_w;
+    for (x = h->occupy_x0; x < h->occupy_x1; x++)
+      row[x] += delta;
+  }
+  port->occupancy_dirty = 1;
+}
+
+/* call whenever a hand's geometry or mapped state changes */
+void
+update_hand_occupancy(Hand *h)
+{
+  Port *port = h->port;
+  if (h->is_icon || !h->toplevel)
+    return;
+  if (!port->occupancy)
+    init_occupancy(port);
+  if (h->occupying) {
+    occupy(port, h, -1);
+    h->occupying = 0;
+  }
+  if (h->mapped) {
+    h->occupy_x0 = xwMAX(h->x, 0) / PLACE_CELL;
+    h->occupy_y0 = xwMAX(h->y, 0) / PLACE_CELL;
+    h->occupy_x1 = xwMIN((h->x + h->width + PLACE_CELL - 1) / PLACE_CELL,
+			 port->occupancy_w);
+    h->occupy_y1 = xwMIN((h->y + h->height + PLACE_CELL - 1) / PLACE_CELL,
+			 port->occupancy_h);
+    if (h->occupy_x0 < h->occupy_x1 && h->occupy_y0 < h->occupy_y1) {
+      occupy(port, h, 1);
+      h->occupying = 1;
+    }
+  }
+}
+
+static void
+build_occupancy_sat(Port *port)
+{
+  int x, y, w = port->occupancy_w, sw = w + 1;
+  unsigned *sat = port->occupancy_sat;
+  for (y = 0; y < port->occupancy_h; y++) {
+    unsigned row_sum = 0;
+    for (x = 0; x < w; x++) {
+      row_sum += port->occupancy[y * w + x];
+      sat[(y + 1) * sw + x + 1] = sat[y * sw + x + 1] + row_sum;
     }
   }
-  *retx = xlist[best];
-  *rety = ylist[best];
+  port->occupancy_dirty = 0;
+}
+
+/* hands covering the cells under a width x height window at (x, y) */
+static unsigned
+occupancy_at(Port *port, int x, int y, int width, int height)
+{
+  int sw = port->occupancy_w + 1;
+  int x0 = xwMAX(x, 0) / PLACE_CELL, y0 = xwMAX(y, 0) / PLACE_CELL;
+  int x1 = xwMIN((x + width + PLACE_CELL - 1) / PLACE_CELL, port->occupancy_w);
+  int y1 = xwMIN((y + height + PLACE_CELL - 1) / PLACE_CELL, port->occupancy_h);
+  unsigned *sat = port->occupancy_sat;
+  if (x0 >= x1 || y0 >= y1)
+    return 0;
+  return sat[y1 * sw + x1] - sat[y0 * sw + x1] - sat[y1 * sw + x0]
+    + sat[y0 * sw + x0];
+}
+
+/* Cache the EWMH work area of the current desktop, which excludes panels.
+   Called at port initialization and on PropertyNotify for either atom, so
+   placing a hand costs no round trips. */
+void
+update_workarea(Port *port)
+{
+  Atom actual_type;
+  int actual_format;
+  unsigned long nitems, bytes_after, desktop = 0;
+  union { unsigned char *uc; long *l; } prop;
+
+  if (XGetWindowProperty(port->display, port->root_window,
+			 port->net_current_desktop_atom, 0, 1, False,
+			 XA_CARDINAL, &actual_type, &actual_format, &nitems,
+			 &bytes_after, &prop.uc) == Success && prop.uc) {
+    if (actual_format == 32 && nitems == 1)
+      desktop = prop.l[0];
+    XFree(prop.uc);
+  }
+
+  if (XGetWindowProperty(port->display, port->root_window,
+			 port->net_workarea_atom, desktop * 4, 4, False,
+			 XA_CARDINAL, &actual_type, &actual_format, &nitems,
+			 &bytes_after, &prop.uc) != Success || !prop.uc) {
+    port->has_workarea = 0;
+    return;
+  }
+  port->has_workarea = (actual_format == 32 && nitems == 4
+			&& prop.l[2] > 0 && prop.l[3] > 0);
+  if (port->has_workarea) {
+    port->workarea_left = prop.l[0];
+    port->workarea_top = prop.l[1];
+    port->workarea_right = prop.l[0] + prop.l[2];
+    port->workarea_bottom = prop.l[1] + prop.l[3];
+  }
+  XFree(prop.uc);
+}
+
+/* Find the position covering the fewest hands for a width x height window
+   on 'slave_port'. Only axes marked random move; ties are broken at
+   random. */
+static void
+place_hand(Port *slave_port, int width, int height, int xrand, int yrand,
+	   int *retx, int *rety)
+{
+  Port *port = slave_port->master;
+  int left = slave_port->left, top = slave_port->top;
+  int right = left + slave_port->width, bottom = top + slave_port->height;
+  int xmin, xmax, ymin, ymax, x, y, nbest = 0;
+  unsigned penalty, best_penalty = ~0U;
+
+  /* stay inside the work area, if it leaves room */
+  if (port->has_workarea
+      && xwMIN(right, port->workarea_right)
+	 - xwMAX(left, port->workarea_left) >= width
+      && xwMIN(bottom, port->workarea_bottom)
+	 - xwMAX(top, port->workarea_top) >= height) {
+    left = xwMAX(left, port->workarea_left);
+    top = xwMAX(top, port->workarea_top);
+    right = xwMIN(right, port->workarea_right);
+    bottom = xwMIN(bottom, port->workarea_bottom);
+  }
+
+  xmin = (xrand ? left : *retx);
+  xmax = (xrand ? xwMAX(right - width, left) : *retx);
+  ymin = (yrand ? top : *rety);
+  ymax = (yrand ? xwMAX(bottom - height, top) : *rety);
+
+  if (!port->occupancy)
+    init_occupancy(port);
+  if (port->occupancy_dirty)
+    build_occupancy_sat(port);
+
+  for (y = ymin; y <= ymax; y += PLACE_CELL)
+    for (x = xmin; x <= xmax; x += PLACE_CELL) {
+      penalty = occupancy_at(port, x, y, width, height);
+      if (penalty < best_penalty) {
+	best_penalty = penalty;
+	nbest = 0;
+      }
+      if (penalty == best_penalty && (rand() >> 4) % ++nbest == 0) {
+	*retx = x;
+	*rety = y;
+      }
+    }
 }
 
 static char *
@@ -139,18 +348,9 @@ new_hand(Port *slave_port, int x, int y)
   if (y == NEW_HAND_CENTER)
     y = slave_port->top + (slave_port->height - height) / 2;
 
-  if (x == NEW_HAND_RANDOM || y == NEW_HAND_RANDOM) {
-    int xs[NEW_HAND_TRIES], ys[NEW_HAND_TRIES], i;
-    int xdist = slave_port->width - width;
-    int ydist = slave_port->height - height;
-    int xrand = (x == NEW_HAND_RANDOM);
-    int yrand = (y == NEW_HAND_RANDOM);
-    for (i = 0; i < NEW_HAND_TRIES; i++) {
-	xs[i] = (xrand ? slave_port->left + ((rand() >> 4) % xdist) : x);
-	ys[i] = (yrand ? slave_port->top + ((rand() >> 4) % ydist) : y);
-    }
-    get_best_position(port, xs, ys, NEW_HAND_TRIES, width, height, &x, &y);
-  }
+  if (x == NEW_HAND_RANDOM || y == NEW_HAND_RANDOM)
+    place_hand(slave_port, width, height, x == NEW_HAND_RANDOM,
+	       y == NEW_HAND_RANDOM, &x, &y);
 
   if (!port->icon_width)
     get_icon_size(port);
@@ -227,12 +427,9 @@ new_hand(Port *slave_port, int x, int y)
   }
 
   /* logo icon hack :-o */
-  {
-      Atom propicon;
-      propicon = XInternAtom(port->display, "_NET_WM_ICON", 0); // 0 = create if not exists
-      XChangeProperty(port->display, nh->w, propicon, XA_CARDINAL, 32, PropModeReplace,
-      (unsigned char*)logo_c32_data, logo_c32_data[0] * logo_c32_data[1] + 2);
-  }
+  XChangeProperty(port->display, nh->w, port->net_wm_icon_atom, XA_CARDINAL,
+		  32, PropModeReplace, (unsigned char *)logo_c32_data,
+		  logo_c32_data[0] * logo_c32_data[1] + 2);
 
   /* beep on every new hand warning window created, if beep */
   if( port->hands && ocurrent->beep ) XBell(port->display, 0);
@@ -292,13 +489,18 @@ new_hand(Port *slave_port, int x, int y)
   nh->configured = 0;
   nh->slideshow = 0;
   nh->clock = 0;
+  nh->clock_minutes = -1;
+  nh->occupying = 0;
   nh->toplevel = 1;
+  init_raiser(&nh->raiser, port, nh->w, 0);
+  set_hand_above(nh, ocurrent->top);
 
   if (port->hands)
     port->hands->prev = nh;
   nh->next = port->hands;
   nh->prev = 0;
   port->hands = nh;
+  index_hand(nh);
 
   nh_icon->port = port;
   nh_icon->icon = nh;
@@ -310,13 +512,18 @@ new_hand(Port *slave_port, int x, int y)
   nh_icon->configured = 0;
   nh_icon->slideshow = 0;
   nh_icon->clock = 0;
+  nh_icon->clock_minutes = -1;
+  nh_icon->occupying = 0;
   nh_icon->permanent = 0;
   nh_icon->toplevel = 1;
+  nh_icon->above = 0;
+  init_raiser(&nh_icon->raiser, port, nh_icon->w, 0);
   if (port->icon_hands)
     port->icon_hands->prev = nh_icon;
   nh_icon->next = port->icon_hands;
   nh_icon->prev = 0;
   port->icon_hands = nh_icon;
+  index_hand(nh_icon);
 
   return nh;
 }
@@ -384,12 +591,17 @@ new_hand_subwindow(Port *port, Window parent, int x, int y)
   nh->configured = 0;
   nh->slideshow = 0;
   nh->clock = 0;
+  nh->clock_minutes = -1;
+  nh->occupying = 0;
   nh->permanent = 0;
   nh->toplevel = 0;
+  nh->above = 0;
+  init_raiser(&nh->raiser, port, nh->w, 0);
   if (port->hands) port->hands->prev = nh;
   nh->next = port->hands;
   nh->prev = 0;
   port->hands = nh;
+  index_hand(nh);
 
   return nh;
 }
@@ -404,6 +616,7 @@ destroy_hand(Hand *h)
   assert(!h->is_icon);
 
   unschedule_data(A_FLASH, h);
+  cancel_raise(&h->raiser);
   /* 29.Jan.2000 oops -- forgot to do this, it caused segfaults */
   if (h->icon)
     unschedule_data(A_FLASH, h->icon);
@@ -420,14 +633,19 @@ destroy_hand(Hand *h)
     XSendEvent(port->display, port->root_window, False,
 	       SubstructureRedirectMask | SubstructureNotifyMask, &event);
     /* mark hand as unmapped now */
-    h->mapped = h->icon->mapped = 0;
+    set_hand_mapped(h->icon, 0);
+    set_hand_mapped(h, 0);
     /* 9.Jul.2006 -- _NET_WM_DESKTOP must be reset after the window is
          withdrawn! The freedesktop.org standards require this. So mark the
          window as withdrawn as well. */
     h->withdrawn = 1;
   } else {
+    if (h->icon)
+      set_hand_mapped(h->icon, 0);
+    set_hand_mapped(h, 0);
     if (h->icon) {
       Hand *ih = h->icon;
+      unindex_hand(ih);
       XDestroyWindow(port->display, ih->w);
       if (ih->prev) ih->prev->next = ih->next;
       else port->icon_hands = ih->next;
@@ -435,6 +653,7 @@ destroy_hand(Hand *h)
       xfree(ih);
     }
     XDestroyWindow(port->display, h->w);
+    unindex_hand(h);
     if (h->prev) h->prev->next = h->next;
     else port->hands = h->next;
     if (h->next) h->next->prev = h->prev;
@@ -445,16 +664,26 @@ destroy_hand(Hand *h)
 
 /* count active hands (mapped or iconified) */
 
+static int nactive_hands;
+
+#define HAND_ACTIVE(h)	((h)->mapped || ((h)->icon && (h)->icon->mapped))
+
 int
 active_hands(void)
 {
-  Hand *h;
-  int i, n = 0;
-  for (i = 0; i < nports; i++)
-    for (h = ports[i]->hands; h; h = h->next)
-      if (h->mapped || h->icon->mapped)
-	n++;
-  return n;
+  return nactive_hands;
+}
+
+/* call instead of setting h->mapped, to keep the count and placement grid
+   current */
+void
+set_hand_mapped(Hand *h, int mapped)
+{
+  Hand *main_hand = (h->is_icon ? h->icon : h);
+  int was_active = HAND_ACTIVE(main_hand);
+  h->mapped = mapped;
+  nactive_hands += HAND_ACTIVE(main_hand) - was_active;
+  update_hand_occupancy(h);
 }
 
 
@@ -464,13 +693,11 @@ Hand *
 window_to_hand(Port *port, Window w, int allow_icons)
 {
   Hand *h;
-  for (h = port->hands; h; h = h->next)
-    if (h->w == w)
-      return h;
-  if (allow_icons)
-    for (h = port->icon_hands; h; h = h->next)
-      if (h->w == w)
-	return h;
+  if (!port)
+    return 0;
+  h = display_window_to_hand(port->display, w);
+  if (h && h->port == port && (allow_icons || !h->is_icon))
+    return h;
   return 0;
 }
 
@@ -480,24 +707,14 @@ window_to_hand(Port *port, Window w, int allow_icons)
 void
 draw_slide(Hand *h)
 {
-  Gif_Stream *gfs;
-  Gif_Image *gfi;
   Port *port;
-  PictureList *pl;
 
   if (!h || !h->slideshow)
     return;
 
-  gfs = h->slideshow;
-  gfi = gfs->images[h->slide];
-  pl = (PictureList *)gfi->user_data;
   port = h->port;
-
-  if (!pl->frames[port->port_number][h->slide].pixmap)
-    (void) Gif_XNextImage(port->gfx, gfs, h->slide,
-			  pl->frames[port->port_number]);
-
-  XSetWindowBackgroundPixmap(port->display, h->w, pl->frames[port->port_number][h->slide].pixmap);
+  XSetWindowBackgroundPixmap(port->display, h->w,
+			     slide_pixmap(h->slideshow, h->slide, port));
   XClearWindow(port->display, h->w);
 
   if (h->clock)
@@ -539,6 +756,9 @@ hand_map_raised(Hand *h)
 	XChangeProperty(h->port->display, h->w, h->port->net_wm_desktop_atom,
 			XA_CARDINAL, 32, PropModeReplace,
 			(unsigned char *)property, 1);
+	/* so does _NET_WM_STATE */
+	if (h->above)
+	    set_hand_above(h, 1);
 	h->withdrawn = 0;
     }
     XMapRaised(h->port->display, h->w);
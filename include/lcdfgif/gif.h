@@ -29,6 +29,8 @@ typedef struct Gif_Colormap	Gif_Colormap;
 typedef struct Gif_Comment	Gif_Comment;
 typedef struct Gif_Extension	Gif_Extension;
 typedef struct Gif_Record	Gif_Record;
+typedef struct Gif_DecodedImage	Gif_DecodedImage;
+typedef struct Gif_DecodedRecord Gif_DecodedRecord;
 
 
 /** GIF_STREAM **/
@@ -230,6 +232,31 @@ struct Gif_Record {
     uint32_t length;
 };
 
+/* A GIF decoded ahead of time, as output by 'giftoc -decoded'. */
+struct Gif_DecodedImage {
+    uint16_t left;
+    uint16_t top;
+    uint16_t width;
+    uint16_t height;
+    uint16_t delay;
+    uint8_t disposal;
+    short transparent;
+    int ncol;
+    const unsigned char *colormap;	/* ncol red, green, blue triples */
+    const unsigned char *image_data;	/* width * height, not interlaced */
+};
+
+struct Gif_DecodedRecord {
+    uint16_t screen_width;
+    uint16_t screen_height;
+    long loopcount;
+    uint8_t background;
+    int nglobal;
+    const unsigned char *global;
+    int nimages;
+    const Gif_DecodedImage *images;
+};
+
 #define GIF_READ_COMPRESSED		1
 #define GIF_READ_UNCOMPRESSED		2
 #define GIF_READ_CONST_RECORD		4
@@ -22,6 +22,8 @@ extern "C" {
 typedef struct Gif_XContext Gif_XContext;
 typedef struct Gif_XColormap Gif_XColormap;
 typedef struct Gif_XFrame Gif_XFrame;
+typedef struct Gif_XShm Gif_XShm;
+typedef struct Gif_XClosestEntry Gif_XClosestEntry;
 
 struct Gif_XContext {
     Display *display;
@@ -34,16 +36,22 @@ struct Gif_XContext {
 
     uint16_t nclosest;
     Gif_Color *closest;
+    Gif_XClosestEntry *closest_cache;
 
     int free_deleted_colormap_pixels;
     Gif_XColormap *xcolormap;
 
     GC image_gc;
     GC mask_gc;
+    GC argb_gc;
 
     unsigned long transparent_pixel;
     unsigned long foreground_pixel;
     int refcount;
+
+    int shm_state;		/* MIT-SHM: 0 untried, 1 works, -1 disabled */
+    Gif_XShm *shm;
+    int render_state;		/* XRender: 0 untried, 1 works, -1 disabled */
 };
 
 struct Gif_XFrame {
@@ -4,13 +4,14 @@
 #include <X11/keysym.h>
 #include <assert.h>
 
-struct timeval lock_message_delay;
+Xwtime lock_message_delay;
 char *lock_password;
 
 #define REDRAW_MESSAGE		((char *)1L)
 #define MAX_MESSAGE_SIZE	(256 + MAX_PASSWORD_SIZE)
 
 static Window *covers;
+static Raiser *cover_raisers;
 static Hand **lock_hands;
 
 static char password[MAX_PASSWORD_SIZE];
@@ -48,7 +49,7 @@ static void
 move_locks(void)
 {
     int i, x, y;
-    struct timeval now;
+    Xwtime now;
     xwGETTIME(now);
     for (i = 0; i < nports; i++)
 	if (covers[i]) {
@@ -154,8 +155,16 @@ check_password(XKeyEvent *xkey)
 }
 
 
+static void
+cover_raised(Raiser *r)
+{
+  (void) r;
+  draw_message(REDRAW_MESSAGE);
+}
+
+
 static int
-lock_alarm_loop(Alarm *a, const struct timeval *now)
+lock_alarm_loop(Alarm *a, const Xwtime *now)
 {
   switch (a->action) {
 
@@ -178,7 +187,7 @@ lock_alarm_loop(Alarm *a, const struct timeval *now)
 
 
 static int
-lock_x_loop(XEvent *e, const struct timeval *now)
+lock_x_loop(XEvent *e, const Xwtime *now)
 {
   Alarm *a;
   Port *port;
@@ -199,8 +208,7 @@ lock_x_loop(XEvent *e, const struct timeval *now)
    case VisibilityNotify:
     if (e->xvisibility.state != VisibilityUnobscured) {
       port = find_port(e->xvisibility.display, e->xvisibility.window);
-      XRaiseWindow(port->display, covers[port->port_number]);
-      draw_message(REDRAW_MESSAGE);
+      request_raise(&cover_raisers[port->port_number], now);
     }
     break;
 
@@ -213,7 +221,7 @@ lock_x_loop(XEvent *e, const struct timeval *now)
 int
 lock(void)
 {
-  struct timeval now, break_over_time;
+  Xwtime now, break_over_time;
   Alarm *a;
   int i, successful_grabs;
 
@@ -238,6 +246,7 @@ lock(void)
   /* create covers */
   if (!covers) {
     covers = (Window *)xmalloc(sizeof(Window) * nports);
+    cover_raisers = xwNEWARR(Raiser, nports);
     lock_hands = (Hand **)xmalloc(sizeof(Hand *) * nports);
   }
 
@@ -265,6 +274,7 @@ lock(void)
 		 ButtonPressMask | ButtonReleaseMask | KeyPressMask
 		 | VisibilityChangeMask | ExposureMask);
     mark_xwrits_window(ports[i], covers[i]);
+    init_raiser(&cover_raisers[i], ports[i], covers[i], cover_raised);
     XMapRaised(ports[i]->display, covers[i]);
     XSync(ports[i]->display, False);
   }
@@ -320,6 +330,7 @@ lock(void)
     if (covers[i]) {
       XUngrabKeyboard(ports[i]->display, CurrentTime);
       destroy_hand(lock_hands[i]);
+      cancel_raise(&cover_raisers[i]);
       XDestroyWindow(ports[i]->display, covers[i]);
       XFlush(ports[i]->display);
     }
@@ -10,15 +10,18 @@
 #ifdef HAVE_XINERAMA
 #include <X11/extensions/Xinerama.h>
 #endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 static Options onormal;
 Options *ocurrent;
 
-struct timeval genesis_time;
-static struct timeval zero = {0, 0};
-struct timeval first_warn_time;
-struct timeval last_key_time;
-static struct timeval normal_type_time;
+Xwtime genesis_time;
+static Xwtime zero = 0;
+Xwtime first_warn_time;
+Xwtime last_key_time;
+static Xwtime normal_type_time;
 
 Gif_Stream *resting_slideshow, *resting_icon_slideshow;
 static const char *resting_slideshow_text = "&resting";
@@ -37,20 +40,18 @@ static const char *bars_slideshow_text = 0;
 int nports;
 Port **ports;
 
-fd_set x_socket_set;
-int max_x_socket;
 XErrorHandler old_x_error_handler;
 
 int check_idle;
-struct timeval idle_time;
+Xwtime idle_time;
 
 int check_mouse;
 int mouse_sensitivity;
-struct timeval check_mouse_time;
+Xwtime check_mouse_time;
 
 int check_quota;
-struct timeval quota_time;
-struct timeval quota_allotment;
+Xwtime quota_time;
+Xwtime quota_allotment;
 
 #define MAX_CHEATS_UNSET -97979797
 int max_cheats;
@@ -59,13 +60,19 @@ static int allow_cheats;
 static int run_once;
 
 int check_xss;
-struct timeval check_xss_time;
+Xwtime check_xss_time;
 
 int check_keystrokes;
 
+int check_xi2;
+
 int verbose;
 
 static int force_mono = 0;
+static int prerender = 1;
+static int frame_cache = 0;
+static int profile_startup = 0;
+static char *frame_cache_dir = 0;
 static int multiscreen = 0;
 
 
@@ -96,6 +103,7 @@ General options:\n\
   --display DISPLAY   Monitor the X display DISPLAY. You can monitor more than\n\
                       one display by giving this option multiple times.\n\
   --multiscreen       Open every screen for each DISPLAY.\n\
+  --profile-startup   Print how long each part of startup takes.\n\
   --help              Print this message and exit.\n\
   --version           Print version number and exit.\n\
 \n");
@@ -106,6 +114,8 @@ Break characteristics:\n\
   +lock               Lock the keyboard during the break.\n\
   password=TEXT       Set the password for unlocking the keyboard.\n\
   +mouse              Monitor your mouse movements.\n\
+  +xi2                Detect typing and mouse movement with XInput2 raw\n\
+                      events instead of watching every window.\n\
   +idle[=TIME]        Leaving the keyboard idle for TIME is the same as taking\n\
                       a break. On by default. Default TIME is breaktime.\n\
   +quota[=TIME]       Leaving the keyboard idle for more than TIME reduces next\n\
@@ -123,6 +133,8 @@ Appearance:\n\
                       Options following 'after' give new behavior.\n\
   +beep               Beep when the warning window appears.\n\
   +breakclock         Show how much time remains during the break.\n\
+  +cache[=DIR]        Keep rendered pictures in DIR (default\n\
+                      $XDG_CACHE_HOME/xwrits) so later runs start faster.\n\
   +clock              Show how long you have ignored the warning window.\n\
   +finger             Be rude.\n\
   +finger=CULTURE     Be rude according to CULTURE. Choices: 'american',\n\
@@ -137,6 +149,8 @@ Appearance:\n\
   +noclose            Don't let anyone close the warning window.\n\
   +noiconify          Don't let anyone iconify the warning window.\n\
   +nomove             Don't let anyone move the warning window.\n\
+  +prerender          Render all pictures soon after startup, so windows\n\
+                      appear without delay. On by default.\n\
   ready-picture=GIF-FILE, okp=GIF-FILE   Show GIF animation on the 'OK' window.\n\
   rest-picture=GIF-FILE, rp=GIF-FILE     Show GIF animation on resting window.\n\
   title=TITLE         Set xwrits window title to TITLE.\n\
@@ -211,11 +225,29 @@ add_port(const char *display_name, Display *display, int screen_number,
 Port *
 find_port(Display *display, Window window)
 {
+    static Display *last_display;
+    static Port *last_display_port;
     int screen_number, i;
+    Hand *h;
+
+    /* our own windows know their port */
+    if (window && (h = display_window_to_hand(display, window)))
+	return h->port;
 
-    /* first, look using only 'display' */
+    /* look using only 'display'; events tend to come in runs from one
+       display, so remember the last answer */
+    if (display == last_display)
+	return last_display_port;
     for (i = 0; i < nports; i++)
-	if (ports[i]->display == display && ports[i]->display_unique)
+	if (ports[i]->display == display && ports[i]->display_unique) {
+	    last_display = display;
+	    last_display_port = ports[i]->master;
+	    return last_display_port;
+	}
+
+    /* a root window names its screen directly */
+    for (i = 0; i < nports; i++)
+	if (ports[i]->display == display && ports[i]->root_window == window)
 	    return ports[i]->master;
 
     /* if display not unique (or not found), try 'screen_number' also */
@@ -340,6 +372,8 @@ default_x_processing(XEvent *e)
   Display *display = e->xany.display;
   Port *port;
 
+  stack_event(e);
+
   switch (e->type) {
 
    case ConfigureNotify:
@@ -351,6 +385,7 @@ default_x_processing(XEvent *e)
     h->y = e->xconfigure.y;
     h->width = e->xconfigure.width;
     h->height = e->xconfigure.height;
+    update_hand_occupancy(h);
     find_root_child(h);
     break;
 
@@ -364,14 +399,14 @@ default_x_processing(XEvent *e)
     port = find_port(display, e->xmap.window);
     if ((h = window_to_hand(port, e->xmap.window, 1))) {
       draw_slide(h);
-      h->mapped = 1;
+      set_hand_mapped(h, 1);
     }
     break;
 
    case UnmapNotify:
     port = find_port(display, e->xunmap.window);
     if ((h = window_to_hand(port, e->xunmap.window, 1)))
-      h->mapped = 0;
+      set_hand_mapped(h, 0);
     break;
 
    case VisibilityNotify:
@@ -391,6 +426,14 @@ default_x_processing(XEvent *e)
       draw_clock(h, 0);
     break;
 
+   case PropertyNotify:
+    port = find_port(display, e->xproperty.window);
+    if (port && e->xproperty.window == port->root_window
+	&& (e->xproperty.atom == port->net_workarea_atom
+	    || e->xproperty.atom == port->net_current_desktop_atom))
+      update_workarea(port);
+    break;
+
    case ClientMessage:
     /* change e->type depending on the message */
     port = find_port(display, e->xclient.window);
@@ -418,10 +461,13 @@ default_x_processing(XEvent *e)
 
    /* for idle processing */
    case CreateNotify: {
-     struct timeval now;
+     Xwtime now;
      xwGETTIME(now);
      port = find_port(display, e->xcreatewindow.window);
-     watch_keystrokes(port, e->xcreatewindow.window, &now);
+     /* the stacking model may select SubstructureNotify on the root even
+	when we aren't crawling */
+     if (check_keystrokes && !port->xi2_opcode)
+       watch_keystrokes(port, e->xcreatewindow.window, &now);
      break;
    }
 
@@ -448,10 +494,9 @@ default_x_processing(XEvent *e)
 /* option parsing */
 
 static int
-strtointerval(char *s, char **stores, struct timeval *iv)
+strtointerval(char *s, char **stores, Xwtime *iv)
 {
   double sec = 0;
-  long integral_sec;
   int ok = 0;
 
   /* read minutes */
@@ -475,9 +520,7 @@ strtointerval(char *s, char **stores, struct timeval *iv)
   /* return */
   if (stores) *stores = s;
   if (!ok || *s != 0) return 0;
-  integral_sec = (long)(floor(sec));
-  iv->tv_sec = integral_sec;
-  iv->tv_usec = (int)(MICRO_PER_SEC * (sec - integral_sec));
+  *iv = (Xwtime)floor(sec * NANO_PER_SEC);
   return 1;
 }
 
@@ -495,7 +538,7 @@ optparse(char *arg, char *option, int unique, char *format, ...)
   va_list val;
   int separate = 0;
   char *opt = option;
-  struct timeval *timeptr;
+  Xwtime *timeptr;
   char **charptr;
   int *intptr;
 
@@ -553,7 +596,7 @@ optparse(char *arg, char *option, int unique, char *format, ...)
 
    case 't': /* time */
    case 'T': /* optional time */
-    timeptr = va_arg(val, struct timeval *);
+    timeptr = va_arg(val, Xwtime *);
     if (!strtointerval(arg, &arg, timeptr))
       error("incorrect time format in %s argument", option);
     break;
@@ -619,7 +662,7 @@ parse_options(int pargc, char **pargv)
   char *arg;
   Options *o = &onormal;
   Options *p;
-  struct timeval flash_delay;
+  Xwtime flash_delay;
   int breaktime_warn_context = 0;
 
   argc = pargc;
@@ -656,6 +699,8 @@ parse_options(int pargc, char **pargv)
     else if (optparse(s, "bc", 2, "t"))
       o->break_clock = optparse_yesno;
 
+    else if (optparse(s, "cache", 3, "tS", &frame_cache_dir))
+      frame_cache = optparse_yesno;
     else if (optparse(s, "canceltime", 2, "sT", &o->cancel_type_time)
 	     || optparse(s, "ct", 2, "sT", &o->cancel_type_time))
       ;
@@ -686,8 +731,8 @@ parse_options(int pargc, char **pargv)
       else
 	slideshow_text_append_built_in(o, "american");
     } else if (optparse(s, "flashtime", 3, "st", &flash_delay)) {
-      double f = flash_delay.tv_sec*MICRO_PER_SEC + flash_delay.tv_usec;
-      o->flash_rate_ratio = f / (DEFAULT_FLASH_DELAY_SEC*MICRO_PER_SEC);
+      o->flash_rate_ratio = (double)flash_delay
+	/ (DEFAULT_FLASH_DELAY_SEC * (double)NANO_PER_SEC);
 
     } else if (optparse(s, "help", 1, "s")) {
       usage();
@@ -736,6 +781,10 @@ parse_options(int pargc, char **pargv)
 
     else if (optparse(s, "password", 1, "ss", &lock_password))
       ;
+    else if (optparse(s, "prerender", 2, "t"))
+      prerender = optparse_yesno;
+    else if (optparse(s, "profile-startup", 3, "t"))
+      profile_startup = optparse_yesno;
 
     else if (optparse(s, "quota", 1, "tT", &quota_time))
       check_quota = optparse_yesno;
@@ -769,6 +818,8 @@ particular purpose.\n");
       ;
     else if (optparse(s, "wp", 2, "ss", &o->slideshow_text))
       ;
+    else if (optparse(s, "xi2", 2, "t"))
+      check_xi2 = optparse_yesno;
     else if (optparse(s, "xss", 1, "t"))
       check_xss = optparse_yesno;
 
@@ -781,12 +832,9 @@ particular purpose.\n");
 /* option checking */
 
 void
-set_fraction_time(struct timeval *result, struct timeval in, double fraction)
+set_fraction_time(Xwtime *result, Xwtime in, double fraction)
 {
-  double d = fraction * (in.tv_sec + (in.tv_usec / (double)MICRO_PER_SEC));
-  long integral_d = (long)(floor(d));
-  result->tv_sec = integral_d;
-  result->tv_usec = (long)(MICRO_PER_SEC * (d - integral_d));
+  *result = (Xwtime)floor(fraction * in);
 }
 
 static void
@@ -915,6 +963,9 @@ default_settings(void)
   check_xss = 0;
 #endif
 
+  /* XInput2 raw events are off by default */
+  check_xi2 = 0;
+
   /* keystrokes monitoring, default is !check_xss */
   if( check_xss)
       check_keystrokes = 0;
@@ -955,6 +1006,13 @@ initialize_slave_port(Port *port)
     port->net_wm_window_type_atom = m->net_wm_window_type_atom;
     port->net_wm_window_type_utility_atom = m->net_wm_window_type_utility_atom;
     port->net_wm_pid_atom = m->net_wm_pid_atom;
+    port->net_wm_icon_atom = m->net_wm_icon_atom;
+    port->net_supported_atom = m->net_supported_atom;
+    port->net_wm_state_atom = m->net_wm_state_atom;
+    port->net_wm_state_above_atom = m->net_wm_state_above_atom;
+    port->net_workarea_atom = m->net_workarea_atom;
+    port->net_current_desktop_atom = m->net_current_desktop_atom;
+    port->wm_supports_above = -1;
     port->xwrits_window_atom = m->xwrits_window_atom;
     port->xwrits_notify_peer_atom = m->xwrits_notify_peer_atom;
     port->xwrits_break_atom = m->xwrits_break_atom;
@@ -963,6 +1021,8 @@ initialize_slave_port(Port *port)
     port->drawable = m->drawable;
     port->clock_fore_gc = m->clock_fore_gc;
     port->clock_hand_gc = m->clock_hand_gc;
+    port->clock_face = m->clock_face;
+    port->clock_face_gc = m->clock_face_gc;
     port->white_gc = m->white_gc;
     port->peers = 0;
     port->npeers = 0;
@@ -972,39 +1032,34 @@ initialize_slave_port(Port *port)
     port->bars_pixmap = None;
 }
 
+static const char * const port_atom_names[] = {
+  "WM_PROTOCOLS", "WM_DELETE_WINDOW", "WM_CLIENT_LEADER", "_MOTIF_WM_HINTS",
+  "_NET_WM_PING", "_NET_WM_DESKTOP", "_NET_WM_WINDOW_TYPE",
+  "_NET_WM_WINDOW_TYPE_UTILITY", "_NET_WM_PID", "_NET_WM_ICON",
+  "XWRITS_WINDOW", "XWRITS_NOTIFY_PEER", "XWRITS_BREAK",
+  "_NET_SUPPORTED", "_NET_WM_STATE", "_NET_WM_STATE_ABOVE",
+  "_NET_WORKAREA", "_NET_CURRENT_DESKTOP"
+};
+#define NPORT_ATOMS	(sizeof(port_atom_names) / sizeof(port_atom_names[0]))
+
+/* Query the server for a master port's visual, colors, font, and atoms.
+   This is the slow part of port initialization, and touches only 'port',
+   so ports on different displays may be connected in parallel. Anything
+   touching global state, like the gfx context's deletion hook, waits for
+   initialize_port(). */
+
 static void
-initialize_port(int portno)
+connect_port(Port *port)
 {
   XVisualInfo visi_template;
   int nv, i;
   XVisualInfo *v;
   XVisualInfo *best_v = 0;
   VisualID default_visualid;
-  Port *port = ports[portno];
   Display *display = port->display;
   int screen_number = port->screen_number;
 
-  /* check that relevant fields have been initialized */
-  assert(display && screen_number >= 0 && screen_number < ScreenCount(display) && port->port_number == portno);
-
-  /* initialize slaves specially */
-  if (port->master != port) {
-      initialize_slave_port(port);
-      return;
-  }
-
-  /* initialize Port fields */
-  port->x_socket = ConnectionNumber(display);
   port->root_window = RootWindow(display, screen_number);
-  port->display_unique = 1;
-  for (i = 0; i < nports && port->display_unique; i++)
-      if (i != portno && ports[i]->display == display && ports[i]->master == ports[i])
-	  port->display_unique = 0;
-
-  /* set X socket */
-  FD_SET(port->x_socket, &x_socket_set);
-  if (port->x_socket > max_x_socket)
-      max_x_socket = port->x_socket;
 
   /* choose the Visual */
   default_visualid = DefaultVisual(display, screen_number)->visualid;
@@ -1058,23 +1113,70 @@ initialize_port(int portno)
   if (!port->font)
       port->font = XLoadQueryFont(display, "fixed");
 
-  /* set gfx */
+  /* set atoms, all in one round trip */
+  {
+    Atom atoms[NPORT_ATOMS];
+    if (!XInternAtoms(display, (char **) port_atom_names, NPORT_ATOMS,
+		      False, atoms))
+      error("%s: could not intern atoms", DisplayString(display));
+    port->wm_protocols_atom = atoms[0];
+    port->wm_delete_window_atom = atoms[1];
+    port->wm_client_leader_atom = atoms[2];
+    port->mwm_hints_atom = atoms[3];
+    port->net_wm_ping_atom = atoms[4];
+    port->net_wm_desktop_atom = atoms[5];
+    port->net_wm_window_type_atom = atoms[6];
+    port->net_wm_window_type_utility_atom = atoms[7];
+    port->net_wm_pid_atom = atoms[8];
+    port->net_wm_icon_atom = atoms[9];
+    port->xwrits_window_atom = atoms[10];
+    port->xwrits_notify_peer_atom = atoms[11];
+    port->xwrits_break_atom = atoms[12];
+    port->net_supported_atom = atoms[13];
+    port->net_wm_state_atom = atoms[14];
+    port->net_wm_state_above_atom = atoms[15];
+    port->net_workarea_atom = atoms[16];
+    port->net_current_desktop_atom = atoms[17];
+  }
+}
+
+static void
+initialize_port(int portno)
+{
+  int i;
+  Port *port = ports[portno];
+  Display *display = port->display;
+  int screen_number = port->screen_number;
+
+  /* check that relevant fields have been initialized */
+  assert(display && screen_number >= 0 && screen_number < ScreenCount(display) && port->port_number == portno);
+
+  /* initialize slaves specially */
+  if (port->master != port) {
+      initialize_slave_port(port);
+      return;
+  }
+
+  /* initialize Port fields; connect_port() has already run */
+  port->x_socket = ConnectionNumber(display);
+  port->display_unique = 1;
+  for (i = 0; i < nports && port->display_unique; i++)
+      if (i != portno && ports[i]->display == display && ports[i]->master == ports[i])
+	  port->display_unique = 0;
+
+  /* set gfx; this adds a deletion hook to a global list, so it is not done
+     in connect_port() */
   port->gfx = Gif_NewXContextFromVisual
     (display, screen_number, port->visual, port->depth, port->colormap);
 
-  /* set atoms */
-  port->wm_protocols_atom = XInternAtom(display, "WM_PROTOCOLS", False);
-  port->wm_delete_window_atom = XInternAtom(display, "WM_DELETE_WINDOW", False);
-  port->wm_client_leader_atom = XInternAtom(display, "WM_CLIENT_LEADER", False);
-  port->mwm_hints_atom = XInternAtom(display, "_MOTIF_WM_HINTS", False);
-  port->net_wm_ping_atom = XInternAtom(display, "_NET_WM_PING", False);
-  port->net_wm_desktop_atom = XInternAtom(display, "_NET_WM_DESKTOP", False);
-  port->net_wm_window_type_atom = XInternAtom(display, "_NET_WM_WINDOW_TYPE", False);
-  port->net_wm_window_type_utility_atom = XInternAtom(display, "_NET_WM_WINDOW_TYPE_UTILITY", False);
-  port->net_wm_pid_atom = XInternAtom(display, "_NET_WM_PID", False);
-  port->xwrits_window_atom = XInternAtom(display, "XWRITS_WINDOW", False);
-  port->xwrits_notify_peer_atom = XInternAtom(display, "XWRITS_NOTIFY_PEER", False);
-  port->xwrits_break_atom = XInternAtom(display, "XWRITS_BREAK", False);
+  /* wait for events on the X socket */
+  watch_display(port);
+  port->wm_supports_above = -1;
+
+  /* cache the work area, and hear when it changes */
+  port->root_event_mask = PropertyChangeMask;
+  XSelectInput(display, port->root_window, port->root_event_mask);
+  update_workarea(port);
 
   /* create first hand for this port, set drawable */
   port->hands = port->icon_hands = port->permanent_hand = 0;
@@ -1104,6 +1206,7 @@ initialize_port(int portno)
       (port->display, port->drawable,
        GCForeground | GCFont | GCSubwindowMode, &gcv);
   }
+  init_clock(port);
 
   /* xwrits peers */
   port->peers = xwNEWARR(Window, 4);
@@ -1113,10 +1216,121 @@ initialize_port(int portno)
   /* initialize other stuff */
   port->icon_width = port->icon_height = 0;
   port->last_mouse_root = None;
+  port->xi2_opcode = 0;
+  port->xi2_activity = 0;
   port->bars_pixmap = None;
 }
 
 
+/* parallel startup */
+
+/* Opening a display and connecting its ports take many round trips. When
+   several displays are given, each display gets its own thread, so startup
+   takes about as long as the slowest display rather than the sum of all. */
+
+typedef struct {
+  Port *port;			/* port that names the display */
+  Display *display;
+#ifdef HAVE_XINERAMA
+  int xinerama_checked;
+  XineramaScreenInfo *xsi;
+  int nxsi;
+#endif
+} DisplayInit;
+
+static DisplayInit *display_inits;
+static int ndisplay_inits;
+static int threaded_startup = 0;
+
+static void
+run_startup_threads(void *(*func)(void *), void **thunks, int n)
+{
+  int i;
+#ifdef HAVE_PTHREAD
+  if (threaded_startup && n > 1) {
+    pthread_t *threads = xwNEWARR(pthread_t, n);
+    char *started = xwNEWARR(char, n);
+    for (i = 0; i < n; i++) {
+      started[i] = (pthread_create(&threads[i], 0, func, thunks[i]) == 0);
+      if (!started[i])
+	func(thunks[i]);
+    }
+    for (i = 0; i < n; i++)
+      if (started[i])
+	pthread_join(threads[i], 0);
+    xfree(threads);
+    xfree(started);
+    return;
+  }
+#endif
+  for (i = 0; i < n; i++)
+    func(thunks[i]);
+}
+
+static void *
+open_display_thread(void *thunk)
+{
+  DisplayInit *di = (DisplayInit *)thunk;
+  di->display = XOpenDisplay(di->port->display_name);
+#ifdef HAVE_XINERAMA
+  if (di->display) {
+    int event_base, error_base;
+    if (XineramaQueryExtension(di->display, &event_base, &error_base))
+      di->xsi = XineramaQueryScreens(di->display, &di->nxsi);
+    di->xinerama_checked = 1;
+  }
+#endif
+  return 0;
+}
+
+static void
+open_displays(int n)
+{
+  void **thunks = xwNEWARR(void *, n);
+  int i;
+  display_inits = xwNEWARR(DisplayInit, n);
+  ndisplay_inits = n;
+  for (i = 0; i < n; i++) {
+    memset(&display_inits[i], 0, sizeof(DisplayInit));
+    display_inits[i].port = ports[i];
+    thunks[i] = &display_inits[i];
+  }
+#ifdef HAVE_PTHREAD
+  /* XInitThreads must precede every other Xlib call */
+  if (n > 1)
+    threaded_startup = (XInitThreads() != 0);
+#endif
+  run_startup_threads(open_display_thread, thunks, n);
+  xfree(thunks);
+}
+
+static void *
+connect_display_thread(void *thunk)
+{
+  Port *port = (Port *)thunk;
+  int i;
+  for (i = port->port_number; i < nports; i++)
+    if (ports[i]->display == port->display && ports[i]->master == ports[i])
+      connect_port(ports[i]);
+  return 0;
+}
+
+static void
+connect_ports(void)
+{
+  void **thunks = xwNEWARR(void *, nports);
+  int i, j, n = 0;
+  for (i = 0; i < nports; i++) {
+    for (j = 0; j < i && ports[j]->display != ports[i]->display; j++)
+      ;
+    if (j == i)
+      thunks[n++] = ports[i];
+  }
+  run_startup_threads(connect_display_thread, thunks, n);
+  xfree(thunks);
+}
+
+
 /* main! */
 
 typedef enum {
@@ -1207,15 +1421,116 @@ main_loop(void)
     }
 }
 
+/* startup profiling */
+
+/* With --profile-startup, report the time, X requests, and X flushes used
+   by each phase of startup. Xlib doesn't count round trips, but every
+   round trip flushes the output buffer, so flushes are a close upper
+   bound. */
+
+static Xwtime profile_last_time;
+static unsigned long profile_last_requests;
+static unsigned long profile_last_flushes;
+
+/* Flushes are counted per display, since the hook runs on whichever thread
+   is using the display, and each display has one thread during startup.
+   The array is filled before any thread starts. */
+/* XESetBeforeFlush is a public libX11 entry point, but only the private
+   Xlibint.h declares it */
+extern void (*XESetBeforeFlush(Display *, int,
+			       void (*)(Display *, XExtCodes *, _Xconst char *,
+					long)))
+  (Display *, XExtCodes *, _Xconst char *, long);
+
+typedef struct {
+  Display *display;
+  unsigned long flushes;
+} ProfileDisplay;
+
+static ProfileDisplay *profile_displays;
+static int nprofile_displays;
+
+static void
+count_flush(Display *display, XExtCodes *codes, _Xconst char *data, long len)
+{
+  int i;
+  (void) codes, (void) data, (void) len;
+  for (i = 0; i < nprofile_displays; i++)
+    if (profile_displays[i].display == display) {
+      profile_displays[i].flushes++;
+      break;
+    }
+}
+
+static unsigned long
+profile_flushes(void)
+{
+  unsigned long n = 0;
+  int i;
+  for (i = 0; i < nprofile_displays; i++)
+    n += profile_displays[i].flushes;
+  return n;
+}
+
+static void
+profile_display(Display *display)
+{
+  XExtCodes *codes;
+  if (!profile_startup || !(codes = XAddExtension(display)))
+    return;
+  xwREARRAY(profile_displays, ProfileDisplay, nprofile_displays + 1);
+  profile_displays[nprofile_displays].display = display;
+  profile_displays[nprofile_displays].flushes = 0;
+  nprofile_displays++;
+  XESetBeforeFlush(display, codes->extension, count_flush);
+}
+
+static unsigned long
+profile_requests(void)
+{
+  unsigned long n = 0;
+  int i, j;
+  for (i = 0; i < nports; i++) {
+    if (!ports[i]->display)
+      continue;
+    for (j = 0; j < i && ports[j]->display != ports[i]->display; j++)
+      ;
+    if (j == i)
+      n += NextRequest(ports[i]->display) - 1;
+  }
+  return n;
+}
+
+static void
+profile_phase(const char *phase)
+{
+  Xwtime now, elapsed;
+  unsigned long requests, flushes;
+  if (!profile_startup)
+    return;
+  xwGETTIME(now);
+  xwSUBTIME(elapsed, now, profile_last_time);
+  requests = profile_requests();
+  flushes = profile_flushes();
+  fprintf(stderr, "xwrits: %-16s %4ld.%03ld ms %6lu requests %4lu flushes\n",
+	  phase, (long)xwTIMEMSEC(elapsed),
+	  (long)(elapsed / NANO_PER_USEC % 1000), requests - profile_last_requests,
+	  flushes - profile_last_flushes);
+  profile_last_time = now;
+  profile_last_requests = requests;
+  profile_last_flushes = flushes;
+}
+
 int
 main(int argc, char *argv[])
 {
   Options *o;
   int i, j, orig_nports;
   int lock_possible = 0;
-  struct timeval now;
+  int raw_input;
+  Xwtime now;
 
-  xwGETTIMEOFDAY(&genesis_time);
+  genesis_time = xwclock();
   init_scheduler();
 
   srand((getpid() + 1) * time(0));
@@ -1225,15 +1540,18 @@ main(int argc, char *argv[])
   /* parse options. remove first argument = program name */
   default_settings();
   parse_options(argc - 1, argv + 1);
+  profile_phase("options");
 
   /* At this point, all ports have 'display_name' valid and everything else
      invalid. Open displays, check multiscreen */
   orig_nports = nports;
+  open_displays(orig_nports);
   for (i = 0; i < orig_nports; i++) {
-      Display *display = XOpenDisplay(ports[i]->display_name);
+      Display *display = display_inits[i].display;
       if (!display)
 	  error("can't open display '%s'", ports[i]->display_name);
       ports[i]->display = display;
+      profile_display(display);
       if (!multiscreen)
 	  ports[i]->screen_number = DefaultScreen(display);
       else if (ScreenCount(display) > 0) {
@@ -1250,7 +1568,10 @@ main(int argc, char *argv[])
 #ifdef HAVE_XINERAMA
       int j, nxsi;
       XineramaScreenInfo *xsi = 0;
-      if (XineramaQueryExtension(p->display, &j, &nxsi))
+      if (i < ndisplay_inits && display_inits[i].xinerama_checked) {
+	  xsi = display_inits[i].xsi;
+	  nxsi = display_inits[i].nxsi;
+      } else if (XineramaQueryExtension(p->display, &j, &nxsi))
 	  xsi = XineramaQueryScreens(p->display, &nxsi);
       if (xsi) {
 	  for (j = 0; j < nxsi; j++) {
@@ -1269,6 +1590,8 @@ main(int argc, char *argv[])
       }
 #endif
   }
+  xfree(display_inits);
+  profile_phase("open displays");
 
   /* check global options */
   if (strlen(lock_password) >= MAX_PASSWORD_SIZE)
@@ -1305,12 +1628,13 @@ main(int argc, char *argv[])
   ready_slideshow = parse_slideshow(ready_slideshow_text, 1, force_mono);
   ready_icon_slideshow = parse_slideshow(ready_icon_slideshow_text, 1, force_mono);
   ocurrent = &onormal;
+  profile_phase("slideshows");
 
   /* create ports */
-  FD_ZERO(&x_socket_set);
-  max_x_socket = 0;
+  connect_ports();
   for (i = 0; i < nports; i++)
     initialize_port(i);
+  profile_phase("ports");
 
   /* initialize pictures using first hand */
   if (lock_possible) {
@@ -1323,19 +1647,31 @@ main(int argc, char *argv[])
       for (i = 0; i < nports; i++)
         ports[i]->bars_pixmap = Gif_XImage(ports[i]->gfx, bars_slideshow, 0);
     }
+    profile_phase("lock pictures");
   }
 
+  /* raw input events replace both the window crawl and the polling */
+  raw_input = 1;
+  for (i = 0; i < nports; i++)
+    if (ports[i]->master == ports[i]) {
+      if (check_xi2 && !watch_raw_input(ports[i]))
+	warning("%s: XInput2 raw events unavailable", ports[i]->display_name);
+      if (!ports[i]->xi2_opcode)
+	raw_input = 0;
+    }
+
   if (check_keystrokes) {
     /* watch keystrokes on all windows */
     xwGETTIME(now);
     old_x_error_handler = XSetErrorHandler(x_error_handler);
     for (i = 0; i < nports; i++)
-        if (ports[i]->master == ports[i])
+        if (ports[i]->master == ports[i] && !ports[i]->xi2_opcode)
             watch_keystrokes(ports[i], ports[i]->root_window, &now);
   }
+  profile_phase("input");
 
   /* start mouse checking */
-  if (check_mouse) {
+  if (check_mouse && !raw_input) {
     Alarm *a = new_alarm(A_MOUSE);
     xwGETTIME(a->timer);
     schedule(a);
@@ -1343,13 +1679,45 @@ main(int argc, char *argv[])
 
 #ifdef HAVE_XSS
   /* start xss checking */
-  if (check_xss) {
+  if (check_xss && !raw_input) {
     Alarm *a = new_alarm(A_XSS_CHECK);
+    for (i = 0; i < nports; i++)
+      if (ports[i]->master == ports[i])
+	watch_idle_time(ports[i]);
     xwGETTIME(a->timer);
     schedule(a);
   }
 #endif
 
+  /* keep rendered pictures on disk */
+  if (frame_cache)
+    init_frame_cache(frame_cache_dir);
+
+  /* render pictures ahead of time, most urgent first */
+  if (prerender) {
+    for (o = &onormal; o; o = o->next) {
+      prerender_slideshow(o->slideshow);
+      prerender_slideshow(o->icon_slideshow);
+    }
+    prerender_slideshow(resting_slideshow);
+    prerender_slideshow(resting_icon_slideshow);
+    prerender_slideshow(ready_slideshow);
+    prerender_slideshow(ready_icon_slideshow);
+    prerender_slideshow(locked_slideshow);
+  }
+
+  if (profile_startup) {
+    profile_phase("idle checks");
+    for (i = 0; i < nports; i++)
+      XFlush(ports[i]->display);
+    profile_phase("flush");
+    xwGETTIME(now);
+    fprintf(stderr, "xwrits: %-16s %4ld.%03ld ms %6lu requests %4lu flushes\n",
+	    "total", (long)xwTIMEMSEC(now),
+	    (long)(now / NANO_PER_USEC % 1000), profile_last_requests,
+	    profile_flushes());
+  }
+
   /* main loop */
   main_loop();
 
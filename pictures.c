@@ -5,6 +5,12 @@
 #include <ctype.h>
 #include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+# include <sys/mman.h>
+#endif
 
 #include "colorpic.c"
 #include "monopic.c"
@@ -13,9 +19,15 @@ Gif_Stream *current_slideshow = 0;
 
 #define NPICTURES 14
 
+#ifdef DECODED_PICTURES
+# define BUILT_IN_RECORD Gif_DecodedRecord
+#else
+# define BUILT_IN_RECORD Gif_Record
+#endif
+
 struct named_record {
   const char *name;
-  const Gif_Record *record;
+  const BUILT_IN_RECORD *record;
   Gif_Stream *gfs;
   const char *synonym;
 };
@@ -50,6 +62,548 @@ struct named_record built_in_pictures[] = {
 };
 
 
+/* frame store */
+
+/* The same picture often appears many times: in every loop of a slideshow,
+   and in several slideshows (a gesture in onormal and again in its next
+   chain, say). Each slideshow image therefore maps to a shared Frame, which
+   identifies what the image's rendered pixmap looks like: the image itself
+   plus whatever it is drawn over. Equal Frames are interned, so each
+   distinct frame is rendered once per port, and its pixmaps are freed when
+   the last slideshow using it goes away. */
+
+#define FRAME_BACKGROUND	0	/* screen filled with background */
+#define FRAME_CLEAR		1	/* 'under' with image area cleared */
+#define FRAME_IMAGE		2	/* image drawn over 'under' (if any) */
+
+typedef struct FrameKey {
+  int kind;
+  Frame *under;
+  const void *data;		/* identifies the image's pixels */
+  uint32_t data_len;		/* length of data, or 0 */
+  int decoded;			/* data is pixels, not compressed */
+  int interlace;
+  Gif_Colormap *colormap;
+  int transparent;
+  int left, top, width, height;
+  int screen_width, screen_height;
+  Gif_Colormap *background_colormap;
+  int background;
+} FrameKey;
+
+struct Frame {
+  FrameKey key;
+  unsigned hash;
+  Frame *hash_next;
+  int refcount;
+  int hashed;
+  uint64_t content_hash;	/* see frame_content_hash */
+  Pixmap pixmap[1];		/* one per port */
+};
+
+static Frame **frame_table;
+static int frame_table_size;
+static int nframes;
+
+static unsigned
+hash_frame_key(const FrameKey *k)
+{
+  const unsigned char *p = (const unsigned char *)k;
+  unsigned hash = 2166136261U;
+  size_t i;
+  for (i = 0; i < sizeof(FrameKey); i++)
+    hash = (hash ^ p[i]) * 16777619U;
+  return hash;
+}
+
+static void
+grow_frame_table(void)
+{
+  int i, new_size = (frame_table_size ? frame_table_size * 2 : 64);
+  Frame **new_table = xwNEWARR(Frame *, new_size);
+  for (i = 0; i < new_size; i++)
+    new_table[i] = 0;
+  for (i = 0; i < frame_table_size; i++)
+    while (frame_table[i]) {
+      Frame *f = frame_table[i];
+      frame_table[i] = f->hash_next;
+      f->hash_next = new_table[f->hash & (new_size - 1)];
+      new_table[f->hash & (new_size - 1)] = f;
+    }
+  xfree(frame_table);
+  frame_table = new_table;
+  frame_table_size = new_size;
+}
+
+static void
+release_frame(Frame *f)
+{
+  while (f && --f->refcount == 0) {
+    Frame **pprev = &frame_table[f->hash & (frame_table_size - 1)];
+    Frame *under = f->key.under;
+    int i;
+    while (*pprev != f)
+      pprev = &(*pprev)->hash_next;
+    *pprev = f->hash_next;
+    nframes--;
+    for (i = 0; i < nports; i++)
+      if (f->pixmap[i])
+	XFreePixmap(ports[i]->display, f->pixmap[i]);
+    xfree(f);
+    f = under;
+  }
+}
+
+/* Return a new reference to the Frame for key k. The key must have been
+   zeroed before it was filled in, since it is hashed and compared
+   bytewise. Takes over k->under's reference. */
+static Frame *
+intern_frame(FrameKey *k)
+{
+  unsigned hash = hash_frame_key(k);
+  Frame *f;
+  int i;
+
+  if (frame_table_size)
+    for (f = frame_table[hash & (frame_table_size - 1)]; f; f = f->hash_next)
+      if (f->hash == hash && memcmp(&f->key, k, sizeof(FrameKey)) == 0) {
+	release_frame(k->under);
+	f->refcount++;
+	return f;
+      }
+
+  if (nframes >= frame_table_size)
+    grow_frame_table();
+  f = (Frame *)xmalloc(sizeof(Frame) + (nports - 1) * sizeof(Pixmap));
+  f->key = *k;
+  f->hash = hash;
+  f->refcount = 1;
+  f->hashed = 0;
+  for (i = 0; i < nports; i++)
+    f->pixmap[i] = None;
+  f->hash_next = frame_table[hash & (frame_table_size - 1)];
+  frame_table[hash & (frame_table_size - 1)] = f;
+  nframes++;
+  return f;
+}
+
+static void
+image_frame_key(FrameKey *k, Gif_Stream *gfs, Gif_Image *gfi)
+{
+  if (gfi->compressed) {
+    k->data = gfi->compressed;
+    k->data_len = gfi->compressed_len;
+  } else if (gfi->image_data) {
+    /* built-in picture decoded by giftoc */
+    k->data = gfi->image_data;
+    k->data_len = gfi->width * gfi->height;
+    k->decoded = 1;
+  } else
+    k->data = gfi;
+  k->interlace = gfi->interlace;
+  k->colormap = (gfi->local ? gfi->local : gfs->global);
+  k->transparent = gfi->transparent;
+  k->left = gfi->left;
+  k->top = gfi->top;
+  k->width = gfi->width;
+  k->height = gfi->height;
+}
+
+/* Work out the Frame for each image in gfs, following the same disposal
+   rules as Gif_XNextImage. */
+static void
+make_frames(Gif_Stream *gfs, Frame **frame)
+{
+  Frame *root, *after = 0;
+  Gif_Colormap *background_colormap = 0;
+  int background = -1;
+  FrameKey k;
+  int i;
+
+  /* the background color, if any; see apply_background in gifx.c */
+  if (gfs->global && gfs->background < gfs->global->ncol
+      && gfs->images[0]->transparent < 0) {
+    background_colormap = gfs->global;
+    background = gfs->background;
+  }
+
+  memset(&k, 0, sizeof(k));
+  k.kind = FRAME_BACKGROUND;
+  k.colormap = (gfs->images[0]->local ? gfs->images[0]->local : gfs->global);
+  k.screen_width = gfs->screen_width;
+  k.screen_height = gfs->screen_height;
+  k.background_colormap = background_colormap;
+  k.background = background;
+  root = intern_frame(&k);
+
+  for (i = 0; i < gfs->nimages; i++) {
+    Gif_Image *gfi = gfs->images[i];
+    Frame *under = (after ? after : root);
+
+    /* the image itself */
+    memset(&k, 0, sizeof(k));
+    k.kind = FRAME_IMAGE;
+    image_frame_key(&k, gfs, gfi);
+    k.screen_width = gfs->screen_width;
+    k.screen_height = gfs->screen_height;
+    if (gfi->left != 0 || gfi->top != 0 || gfi->width != gfs->screen_width
+	|| gfi->height != gfs->screen_height || gfi->transparent >= 0) {
+      k.under = under;
+      under->refcount++;
+    }
+    frame[i] = intern_frame(&k);
+
+    /* what the next image is drawn over */
+    if (gfi->disposal == GIF_DISPOSAL_BACKGROUND) {
+      memset(&k, 0, sizeof(k));
+      k.kind = FRAME_CLEAR;
+      image_frame_key(&k, gfs, gfi);
+      k.under = under;
+      under->refcount++;
+      k.screen_width = gfs->screen_width;
+      k.screen_height = gfs->screen_height;
+      k.background_colormap = background_colormap;
+      k.background = background;
+      release_frame(after);
+      after = intern_frame(&k);
+    } else if (gfi->disposal != GIF_DISPOSAL_PREVIOUS) {
+      frame[i]->refcount++;
+      release_frame(after);
+      after = frame[i];
+    }
+  }
+
+  release_frame(after);
+  release_frame(root);
+}
+
+/* on-disk frame cache */
+
+/* With +cache, rendered frames are also saved as raw image data, named by a
+   hash of everything that went into them plus the visual's pixel format.
+   Later runs map the file and send it straight to the server, skipping GIF
+   decoding and color conversion. Only TrueColor visuals are cached, since
+   elsewhere pixel values depend on which colors the server allocated. */
+
+#if defined(__cplusplus) || defined(c_plusplus)
+#define VISUAL_CLASS c_class
+#else
+#define VISUAL_CLASS class
+#endif
+
+#define FRAME_CACHE_MAGIC	0x78774631U	/* version 1 */
+
+typedef struct FrameCacheHeader {
+  uint32_t magic;
+  uint32_t width;
+  uint32_t height;
+  uint32_t depth;
+  uint32_t bits_per_pixel;
+  uint32_t bytes_per_line;
+  uint32_t bitmap_pad;
+  uint32_t byte_order;
+  uint32_t red_mask;
+  uint32_t green_mask;
+  uint32_t blue_mask;
+  uint32_t padding;
+} FrameCacheHeader;
+
+static char *frame_cache_dir;
+
+void
+init_frame_cache(const char *dir)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+  const char *base = getenv("XDG_CACHE_HOME");
+  char *s;
+
+  if (!dir) {
+    if (base && *base) {
+      s = xwNEWARR(char, strlen(base) + 8);
+      sprintf(s, "%s/xwrits", base);
+    } else if ((base = getenv("HOME"))) {
+      s = xwNEWARR(char, strlen(base) + 15);
+      sprintf(s, "%s/.cache", base);
+      mkdir(s, 0700);
+      strcat(s, "/xwrits");
+    } else {
+      warning("no HOME directory for +cache");
+      return;
+    }
+  } else {
+    s = xwNEWARR(char, strlen(dir) + 1);
+    strcpy(s, dir);
+  }
+
+  if (mkdir(s, 0700) < 0 && errno != EEXIST) {
+    warning("%s: %s", s, strerror(errno));
+    xfree(s);
+  } else
+    frame_cache_dir = s;
+#else
+  (void) dir;
+  warning("+cache is not supported on this system");
+#endif
+}
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+
+static uint64_t
+hash_bytes(uint64_t hash, const void *v, size_t n)
+{
+  const unsigned char *p = (const unsigned char *)v;
+  while (n--)
+    hash = (hash ^ *p++) * 1099511628211ULL;
+  return hash;
+}
+
+static uint64_t
+hash_int(uint64_t hash, int32_t x)
+{
+  return hash_bytes(hash, &x, sizeof(x));
+}
+
+static uint64_t
+hash_colormap(uint64_t hash, const Gif_Colormap *gfcm)
+{
+  int i;
+  if (!gfcm)
+    return hash_int(hash, -1);
+  hash = hash_int(hash, gfcm->ncol);
+  for (i = 0; i < gfcm->ncol; i++) {
+    const Gif_Color *c = &gfcm->col[i];
+    unsigned char rgb[3];
+    rgb[0] = c->red;
+    rgb[1] = c->green;
+    rgb[2] = c->blue;
+    hash = hash_bytes(hash, rgb, 3);
+  }
+  return hash;
+}
+
+/* A hash of a frame's contents, rather than of the pointers in its key;
+   0 if it cannot be computed. */
+static uint64_t
+frame_content_hash(Frame *f)
+{
+  const FrameKey *k = &f->key;
+  uint64_t hash = 14695981039346656037ULL;
+
+  if (f->hashed)
+    return f->content_hash;
+  f->hashed = 1;
+  f->content_hash = 0;
+
+  hash = hash_int(hash, k->kind);
+  hash = hash_int(hash, k->screen_width);
+  hash = hash_int(hash, k->screen_height);
+  if (k->kind != FRAME_BACKGROUND) {
+    hash = hash_int(hash, k->left);
+    hash = hash_int(hash, k->top);
+    hash = hash_int(hash, k->width);
+    hash = hash_int(hash, k->height);
+  }
+  if (k->kind == FRAME_IMAGE) {
+    if (!k->data_len)
+      return 0;
+    hash = hash_int(hash, k->decoded);
+    hash = hash_int(hash, k->interlace);
+    hash = hash_int(hash, k->transparent);
+    hash = hash_int(hash, k->data_len);
+    hash = hash_bytes(hash, k->data, k->data_len);
+  }
+  if (k->kind != FRAME_CLEAR)
+    hash = hash_colormap(hash, k->colormap);
+  if (k->kind != FRAME_IMAGE) {
+    hash = hash_int(hash, k->background);
+    if (k->background >= 0)
+      hash = hash_colormap(hash, k->background_colormap);
+  }
+  if (k->under) {
+    uint64_t under_hash = frame_content_hash(k->under);
+    if (!under_hash)
+      return 0;
+    hash = hash_bytes(hash, &under_hash, sizeof(under_hash));
+  }
+
+  f->content_hash = (hash ? hash : 1);
+  return f->content_hash;
+}
+
+/* Return the cache file name for f on port, or 0 if f can't be cached. */
+static char *
+frame_cache_name(Frame *f, Port *port)
+{
+  uint64_t hash;
+  char *s;
+
+  if (!frame_cache_dir || port->visual->VISUAL_CLASS != TrueColor
+      || !(hash = frame_content_hash(f)))
+    return 0;
+
+  hash = hash_int(hash, port->depth);
+  hash = hash_int(hash, port->visual->red_mask);
+  hash = hash_int(hash, port->visual->green_mask);
+  hash = hash_int(hash, port->visual->blue_mask);
+  hash = hash_int(hash, ImageByteOrder(port->display));
+
+  s = xwNEWARR(char, strlen(frame_cache_dir) + 22);
+  sprintf(s, "%s/%08lx%08lx", frame_cache_dir,
+	  (unsigned long)(hash >> 32), (unsigned long)(hash & 0xFFFFFFFFU));
+  return s;
+}
+
+static Pixmap
+load_cached_frame(Port *port, const char *name, int width, int height)
+{
+  Gif_XContext *gfx = port->gfx;
+  const FrameCacheHeader *hdr;
+  XImage *ximage = 0;
+  Pixmap pixmap = None;
+  struct stat st;
+  void *data;
+  int fd;
+
+  if ((fd = open(name, O_RDONLY)) < 0)
+    return None;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(FrameCacheHeader)
+      || (data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+	 == MAP_FAILED) {
+    close(fd);
+    return None;
+  }
+  close(fd);
+
+  hdr = (const FrameCacheHeader *)data;
+  if (hdr->magic == FRAME_CACHE_MAGIC
+      && hdr->width == (uint32_t)width && hdr->height == (uint32_t)height
+      && hdr->depth == (uint32_t)port->depth
+      && hdr->byte_order == (uint32_t)ImageByteOrder(port->display)
+      && hdr->red_mask == port->visual->red_mask
+      && hdr->green_mask == port->visual->green_mask
+      && hdr->blue_mask == port->visual->blue_mask
+      && st.st_size == (off_t)(sizeof(FrameCacheHeader)
+			       + (off_t)hdr->bytes_per_line * height))
+    ximage = XCreateImage(port->display, port->visual, port->depth, ZPixmap,
+			  0, (char *)(hdr + 1), width, height,
+			  hdr->bitmap_pad, hdr->bytes_per_line);
+
+  if (ximage && (uint32_t)ximage->bits_per_pixel == hdr->bits_per_pixel) {
+    pixmap = XCreatePixmap(port->display, gfx->drawable, width, height,
+			   port->depth);
+    if (!gfx->image_gc)
+      gfx->image_gc = XCreateGC(port->display, pixmap, 0, 0);
+    /* XPutImage is done with the data once it returns */
+    XPutImage(port->display, pixmap, gfx->image_gc, ximage, 0, 0, 0, 0,
+	      width, height);
+  }
+
+  if (ximage) {
+    ximage->data = 0;
+    XDestroyImage(ximage);
+  }
+  munmap(data, st.st_size);
+  return pixmap;
+}
+
+static void
+save_cached_frame(Port *port, const char *name, Pixmap pixmap,
+		  int width, int height)
+{
+  XImage *ximage = XGetImage(port->display, pixmap, 0, 0, width, height,
+			     AllPlanes, ZPixmap);
+  FrameCacheHeader hdr;
+  char *tmp;
+  int fd, ok;
+
+  if (!ximage)
+    return;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = FRAME_CACHE_MAGIC;
+  hdr.width = width;
+  hdr.height = height;
+  hdr.depth = ximage->depth;
+  hdr.bits_per_pixel = ximage->bits_per_pixel;
+  hdr.bytes_per_line = ximage->bytes_per_line;
+  hdr.bitmap_pad = ximage->bitmap_pad;
+  hdr.byte_order = ximage->byte_order;
+  hdr.red_mask = port->visual->red_mask;
+  hdr.green_mask = port->visual->green_mask;
+  hdr.blue_mask = port->visual->blue_mask;
+
+  /* write to a temporary file, then rename, so other xwritses never see a
+     partial frame */
+  tmp = xwNEWARR(char, strlen(name) + 24);
+  sprintf(tmp, "%s.%ld", name, (long)getpid());
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd >= 0) {
+    size_t len = (size_t)ximage->bytes_per_line * height;
+    ok = (write(fd, &hdr, sizeof(hdr)) == (ssize_t)sizeof(hdr)
+	  && write(fd, ximage->data, len) == (ssize_t)len);
+    if (close(fd) < 0 || !ok || rename(tmp, name) < 0)
+      unlink(tmp);
+  }
+
+  xfree(tmp);
+  XDestroyImage(ximage);
+}
+
+#endif /* HAVE_MMAP */
+
+Pixmap
+slide_pixmap(Gif_Stream *gfs, int slide, Port *port)
+{
+  PictureList *pl = (PictureList *)gfs->images[slide]->user_data;
+  int p = port->port_number;
+  Gif_XFrame *frames = pl->frames[p];
+  int i;
+
+  if (frames[slide].pixmap)
+    return frames[slide].pixmap;
+
+  /* use any frames rendered through other slideshows */
+  for (i = 0; i < gfs->nimages; i++)
+    if (!frames[i].pixmap)
+      frames[i].pixmap = pl->frame[i]->pixmap[p];
+
+  if (!frames[slide].pixmap) {
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+    char *cache_name = frame_cache_name(pl->frame[slide], port);
+    if (cache_name
+	&& (frames[slide].pixmap = load_cached_frame
+	    (port, cache_name, gfs->screen_width, gfs->screen_height))) {
+      pl->frame[slide]->pixmap[p] = frames[slide].pixmap;
+      xfree(cache_name);
+      return frames[slide].pixmap;
+    }
+#endif
+
+    (void) Gif_XNextImage(port->gfx, gfs, slide, frames);
+    /* hand newly rendered pixmaps over to their Frames */
+    for (i = 0; i < gfs->nimages; i++) {
+      Frame *f = pl->frame[i];
+      if (!frames[i].pixmap || frames[i].pixmap == f->pixmap[p])
+	continue;
+      if (f->pixmap[p]) {
+	XFreePixmap(port->display, frames[i].pixmap);
+	frames[i].pixmap = f->pixmap[p];
+      } else
+	f->pixmap[p] = frames[i].pixmap;
+    }
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+    if (cache_name && frames[slide].pixmap)
+      save_cached_frame(port, cache_name, frames[slide].pixmap,
+			gfs->screen_width, gfs->screen_height);
+    xfree(cache_name);
+#endif
+  }
+
+  return frames[slide].pixmap;
+}
+
+
 static void
 free_picturelist(void *v)
 {
@@ -57,7 +611,10 @@ free_picturelist(void *v)
   int i;
   if (--pl->refcount == 0) {
     for (i = 0; i < nports; i++)
-      Gif_DeleteXFrames(ports[i]->gfx, pl->gfs, pl->frames[i]);
+      Gif_DeleteArray(pl->frames[i]);
+    for (i = 0; i < pl->gfs->nimages; i++)
+      release_frame(pl->frame[i]);
+    xfree(pl->frame);
     xfree(pl);
   }
 }
@@ -75,6 +632,8 @@ add_picturelist(Gif_Stream *gfs, int clock_x_off, int clock_y_off)
   pl->clock_y_off = clock_y_off;
   pl->gfs = gfs;
   pl->refcount = 0;
+  pl->frame = xwNEWARR(Frame *, gfs->nimages);
+  make_frames(gfs, pl->frame);
   for (i = 0; i < nports; i++)
     if (!(pl->frames[i] = Gif_NewXFrames(gfs)))
       return 0;
@@ -87,6 +646,59 @@ add_picturelist(Gif_Stream *gfs, int clock_x_off, int clock_y_off)
 }
 
 
+#ifdef DECODED_PICTURES
+/* Built-in pictures were decoded by giftoc at build time. Make a stream
+   that uses their image data in place. */
+
+static Gif_Colormap *
+decoded_colormap(int ncol, const unsigned char *rgb)
+{
+  Gif_Colormap *gfcm = Gif_NewFullColormap(ncol, 256);
+  int i;
+  for (i = 0; i < ncol; i++) {
+    gfcm->col[i].haspixel = 0;
+    gfcm->col[i].red = rgb[3*i];
+    gfcm->col[i].green = rgb[3*i + 1];
+    gfcm->col[i].blue = rgb[3*i + 2];
+    gfcm->col[i].pixel = 0;
+  }
+  gfcm->refcount = 1;
+  return gfcm;
+}
+
+static Gif_Stream *
+read_decoded_record(const Gif_DecodedRecord *dr)
+{
+  Gif_Stream *gfs = Gif_NewStream();
+  int i;
+
+  gfs->screen_width = dr->screen_width;
+  gfs->screen_height = dr->screen_height;
+  gfs->loopcount = dr->loopcount;
+  gfs->background = dr->background;
+  if (dr->global)
+    gfs->global = decoded_colormap(dr->nglobal, dr->global);
+
+  for (i = 0; i < dr->nimages; i++) {
+    const Gif_DecodedImage *di = &dr->images[i];
+    Gif_Image *gfi = Gif_NewImage();
+    gfi->left = di->left;
+    gfi->top = di->top;
+    gfi->width = di->width;
+    gfi->height = di->height;
+    gfi->delay = di->delay;
+    gfi->disposal = di->disposal;
+    gfi->transparent = di->transparent;
+    if (di->colormap)
+      gfi->local = decoded_colormap(di->ncol, di->colormap);
+    Gif_SetUncompressedImage(gfi, (uint8_t *)di->image_data, 0, 0);
+    Gif_AddImage(gfs, gfi);
+  }
+
+  return gfs;
+}
+#endif
+
 static Gif_Stream *
 get_built_in_image(const char *name)
 {
@@ -107,9 +719,13 @@ get_built_in_image(const char *name)
     return nr->gfs;
   }
 
+#ifdef DECODED_PICTURES
+  nr->gfs = gfs = read_decoded_record(nr->record);
+#else
   nr->gfs = gfs =
     Gif_FullReadRecord(nr->record, GIF_READ_COMPRESSED | GIF_READ_CONST_RECORD,
 		       0, 0);
+#endif
   if (!gfs)
     return 0;
 
@@ -130,7 +746,7 @@ static Gif_Image *
 clone_image_skeleton(Gif_Image *gfi)
 {
   Gif_Image *ngfi = Gif_NewImage();
-  assert(!gfi->image_data && gfi->compressed);
+  assert(gfi->image_data || gfi->compressed);
   ngfi->local = gfi->local;
   if (ngfi->local) ngfi->local->refcount++;
   ngfi->transparent = gfi->transparent;
@@ -138,9 +754,13 @@ clone_image_skeleton(Gif_Image *gfi)
   ngfi->top = gfi->top;
   ngfi->width = gfi->width;
   ngfi->height = gfi->height;
-  ngfi->compressed = gfi->compressed;
-  ngfi->compressed_len = gfi->compressed_len;
-  ngfi->free_compressed = 0;
+  if (gfi->compressed) {
+    ngfi->compressed = gfi->compressed;
+    ngfi->compressed_len = gfi->compressed_len;
+    ngfi->free_compressed = 0;
+  } else
+    /* built-in picture decoded by giftoc */
+    Gif_SetUncompressedImage(ngfi, gfi->image_data, 0, 0);
   ngfi->delay = gfi->delay;
   gfi->refcount++;
   return ngfi;
@@ -212,6 +832,33 @@ add_stream_to_slideshow(Gif_Stream *add, Gif_Stream *gfs,
   }
 }
 
+/* Read a GIF from disk. Where possible, map the file into memory and read it
+   as a constant record, so that compressed image data is used in place
+   instead of being copied. Slideshows last as long as xwrits does, so a
+   mapping is only removed if its file contributes no images. */
+static Gif_Stream *
+read_gif_file(FILE *f)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+  struct stat st;
+  if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0
+      && (off_t)(uint32_t)st.st_size == st.st_size) {
+    void *data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+    if (data != MAP_FAILED) {
+      Gif_Record rec;
+      Gif_Stream *gfs;
+      rec.data = (const unsigned char *)data;
+      rec.length = st.st_size;
+      gfs = Gif_FullReadRecord(&rec, GIF_READ_CONST_RECORD, 0, 0);
+      if (!gfs || gfs->nimages == 0)
+	munmap(data, st.st_size);
+      return gfs;
+    }
+  }
+#endif
+  return Gif_FullReadFile(f, GIF_READ_COMPRESSED, 0, 0);
+}
+
 Gif_Stream *
 parse_slideshow(const char *slideshowtext, double flash_rate_ratio, int mono)
 {
@@ -271,7 +918,7 @@ parse_slideshow(const char *slideshowtext, double flash_rate_ratio, int mono)
 
     /* load file from disk */
     f = fopen(n, "rb");
-    add = Gif_FullReadFile(f, GIF_READ_COMPRESSED, 0, 0);
+    add = (f ? read_gif_file(f) : 0);
     if (!f)
 	error("%s: %s", n, strerror(errno));
     else if (!add || (add->nimages == 0 && add->errors > 0))
@@ -311,11 +958,11 @@ parse_slideshow(const char *slideshowtext, double flash_rate_ratio, int mono)
 
 
 void
-set_slideshow(Hand *h, Gif_Stream *gfs, const struct timeval *now_ptr)
+set_slideshow(Hand *h, Gif_Stream *gfs, const Xwtime *now_ptr)
 {
   int which_im = 0;
   Alarm *a;
-  struct timeval t;
+  Xwtime t;
   Port *port = h->port;
 
   if (h->slideshow == gfs)
@@ -381,9 +1028,94 @@ void
 set_all_slideshows(Hand *hands, Gif_Stream *gfs)
 {
   Hand *h;
-  struct timeval now;
+  Xwtime now;
   xwGETTIME(now);
   for (h = hands; h; h = h->next)
     set_slideshow(h, gfs, &now);
   current_slideshow = gfs;
 }
+
+
+/* pre-rendering */
+
+/* draw_slide renders each frame the first time it's shown, which puts GIF
+   decoding, color allocation, and XPutImage between the user and the first
+   warning. Instead, render every frame of the known slideshows on every
+   master port soon after startup, one frame per A_PRERENDER alarm, so X
+   events are never held up for long. Hands always belong to master ports,
+   so Xinerama slaves are skipped. */
+
+static Gif_Stream **prerender_queue;
+static int prerender_nqueue;
+static int prerender_capacity;
+static int prerender_pos;		/* stream being rendered */
+static int prerender_image;		/* next image in that stream */
+static int prerender_port;		/* next port for that image */
+static int prerender_count;
+static Xwtime prerender_began;
+static const Xwtime prerender_gap = NANO_PER_MSEC;
+
+void
+prerender_slideshow(Gif_Stream *gfs)
+{
+  Alarm *a;
+  int i;
+  if (!gfs || gfs->nimages == 0)
+    return;
+  for (i = 0; i < prerender_nqueue; i++)
+    if (prerender_queue[i] == gfs)
+      return;
+  if (prerender_nqueue == prerender_capacity) {
+    prerender_capacity = (prerender_capacity ? prerender_capacity * 2 : 8);
+    xwREARRAY(prerender_queue, Gif_Stream *, prerender_capacity);
+  }
+  prerender_queue[prerender_nqueue++] = gfs;
+
+  /* start rendering if we weren't already */
+  if (prerender_pos == prerender_nqueue - 1) {
+    a = new_alarm(A_PRERENDER);
+    xwGETTIME(a->timer);
+    if (prerender_count == 0)
+      prerender_began = a->timer;
+    schedule(a);
+  }
+}
+
+void
+prerender_slide(Alarm *a, const Xwtime *now)
+{
+  while (prerender_pos < prerender_nqueue) {
+    Gif_Stream *gfs = prerender_queue[prerender_pos];
+    PictureList *pl = (PictureList *)gfs->images[0]->user_data;
+    int p;
+
+    if (prerender_port == nports) {
+      prerender_port = 0;
+      prerender_image++;
+    }
+    if (!pl || prerender_image == gfs->nimages) {
+      prerender_image = 0;
+      prerender_pos++;
+      continue;
+    }
+
+    p = prerender_port++;
+    if (ports[p]->master == ports[p]
+	&& !pl->frame[prerender_image]->pixmap[p]) {
+      (void) slide_pixmap(gfs, prerender_image, ports[p]);
+      prerender_count++;
+      xwADDTIME(a->timer, *now, prerender_gap);
+      schedule(a);
+      return;
+    }
+  }
+
+  if (verbose) {
+    Xwtime elapsed;
+    xwGETTIME(elapsed);
+    xwSUBTIME(elapsed, elapsed, prerender_began);
+    fprintf(stderr, "Pre-rendered %d frames in %ld.%03ld sec\n",
+	    prerender_count, (long)xwTIMESEC(elapsed),
+	    (long)(xwTIMEMSEC(elapsed) % 1000));
+  }
+}
@@ -6,12 +6,12 @@
 
 /* wait for break */
 
-static struct timeval wait_over_time;
+static Xwtime wait_over_time;
 
 static int
-wait_x_loop(XEvent *e, const struct timeval *now)
+wait_x_loop(XEvent *e, const Xwtime *now)
 {
-  struct timeval diff;
+  Xwtime diff;
 
   if (e->type == KeyPress || e->type == MotionNotify
       || e->type == ButtonPress) {
@@ -37,13 +37,13 @@ wait_x_loop(XEvent *e, const struct timeval *now)
 }
 
 static int
-adjust_wait_time(struct timeval *wait_began_time, const struct timeval *type_time)
+adjust_wait_time(Xwtime *wait_began_time, const Xwtime *type_time)
      /* Adjust the time to wake up to reflect the length of the break, if
         under check_quota. Want to be able to type for slightly longer if
         you've been taking mini-breaks. */
 {
-  struct timeval this_break_time;
-  struct timeval break_end_time;
+  Xwtime this_break_time;
+  Xwtime break_end_time;
   assert(check_quota);
 
   /* Find the time when this break should end = beginning of wait + type delay
@@ -69,10 +69,10 @@ adjust_wait_time(struct timeval *wait_began_time, const struct timeval *type_tim
 }
 
 int
-wait_for_break(const struct timeval *type_time)
+wait_for_break(const Xwtime *type_time)
 {
   int val, i;
-  struct timeval wait_began_time;
+  Xwtime wait_began_time;
 
   /* Schedule wait_over_time */
   xwGETTIME(wait_began_time);
@@ -120,10 +120,10 @@ wait_for_break(const struct timeval *type_time)
 /* rest */
 
 static int current_cheats;
-static struct timeval break_over_time;
+static Xwtime break_over_time;
 
 static int
-rest_x_loop(XEvent *e, const struct timeval *now)
+rest_x_loop(XEvent *e, const Xwtime *now)
 {
   /* If the break is over, wake up. */
   if (xwTIMEGEQ(*now, break_over_time))
@@ -142,9 +142,9 @@ rest_x_loop(XEvent *e, const struct timeval *now)
 }
 
 void
-calculate_break_time(struct timeval *break_over_time, const struct timeval *now)
+calculate_break_time(Xwtime *break_over_time, const Xwtime *now)
 {
-  struct timeval this_break_time;
+  Xwtime this_break_time;
 
   /* determine length of this break. usually break_time; can be different if
      check_quota is on */
@@ -165,7 +165,7 @@ calculate_break_time(struct timeval *break_over_time, const struct timeval *now)
 int
 rest(void)
 {
-  struct timeval now;
+  Xwtime now;
   Alarm *a;
   int tran, i;
 
@@ -194,10 +194,12 @@ rest(void)
   /* reschedule mouse position query timing: allow 5 seconds for people to
      jiggle the mouse before we save its position */
   if (check_mouse) {
-    a = grab_alarm_data(A_MOUSE, 0, 0);
-    a->timer = now;
-    a->timer.tv_sec += 5;
-    schedule(a);
+    mouse_grace_time = now;
+    mouse_grace_time += 5 * (Xwtime)NANO_PER_SEC;
+    if ((a = grab_alarm_data(A_MOUSE, 0, 0))) {
+      a->timer = mouse_grace_time;
+      schedule(a);
+    }
     for (i = 0; i < nports; i++)
       ports[i]->last_mouse_root = None;
   }
@@ -224,7 +226,7 @@ rest(void)
 /* ready */
 
 static int
-ready_x_loop(XEvent *e, const struct timeval *now)
+ready_x_loop(XEvent *e, const Xwtime *now)
 {
   if (e->type == KeyPress || e->type == MotionNotify
       || e->type == ButtonPress) {
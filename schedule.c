@@ -1,10 +1,34 @@
 #include <config.h>
 #include "xwrits.h"
+#include <X11/Xlibint.h>	/* only for query_keystroke_batch() */
+#include <X11/Xatom.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(HAVE_CLOCK_GETTIME) && defined(HAVE_SYS_TIMERFD_H)
+# include <sys/timerfd.h>
+# define USE_TIMERFD 1
+#endif
+
+/* Pending alarms live in a binary min-heap ordered by timer (ties broken by
+   scheduling order, so equal timers fire first-come first-served). Every
+   pending alarm is also hashed by (action, data1), so looking up the alarm
+   for a particular hand or window doesn't require a walk over all alarms. */
+
+static Alarm **alarm_heap;
+static int nalarms;
+static int alarm_heap_capacity;
+static unsigned long alarm_sequence;
 
-static Alarm alarm_sentinel;
+static Alarm **alarm_buckets;
+static unsigned alarm_nbuckets;
+
+#define NACTIONS 16
+static int alarm_action_count[NACTIONS];
 
 /*****************************************************************************/
 /*  Idle functions							     */
@@ -16,7 +40,7 @@ static Alarm alarm_sentinel;
 
 /* Support for Xidle is *not* included. */
 
-struct timeval register_keystrokes_delay;
+Xwtime register_keystrokes_delay;
 static unsigned long created_count;
 static unsigned long key_press_selected_count;
 
@@ -46,7 +70,7 @@ x_error_handler(Display *d, XErrorEvent *error)
 
 
 void
-watch_keystrokes(Port *port, Window w, const struct timeval *now)
+watch_keystrokes(Port *port, Window w, const Xwtime *now)
 {
   Display *display = port->display;
   Window root, parent, *children;
@@ -60,7 +84,8 @@ watch_keystrokes(Port *port, Window w, const struct timeval *now)
   if (XQueryTree(display, w, &root, &parent, &children, &nchildren) == 0)
     return; /* the window doesn't exist */
 
-  XSelectInput(display, w, SubstructureNotifyMask);
+  XSelectInput(display, w, SubstructureNotifyMask
+	       | (w == port->root_window ? port->root_event_mask : 0));
   created_count++;
   if (verbose)
       fprintf(stderr, "Window 0x%x: watching for subwindows\n", (unsigned)w);
@@ -78,8 +103,174 @@ watch_keystrokes(Port *port, Window w, const struct timeval *now)
   if (children) XFree(children);
 }
 
+/* Registering keystrokes takes three queries per window (attributes, class
+   hint, XWRITS_WINDOW property). Rather than waiting for each reply in turn,
+   register_keystrokes queues the window; flush_register_keystrokes then sends
+   the queries for every queued window on a display at once, collects the
+   replies with an Xlib async handler, and waits for a single round trip. */
+
+typedef struct {
+  Port *port;
+  Window w;
+  unsigned long event_masks;	/* all_event_masks | do_not_propagate_mask */
+  char *class_hint;		/* WM_CLASS property, or 0 */
+  int class_hint_len;
+  Window peer;			/* value of XWRITS_WINDOW property */
+  unsigned has_attributes: 1;
+  unsigned has_class_hint: 1;
+} KeystrokeQuery;
+
+#define KEYSTROKE_QUERY_REQUESTS 3
+
+static KeystrokeQuery *keystroke_queries;
+static int nkeystroke_queries;
+static int keystroke_queries_capacity;
+
 void
 register_keystrokes(Port *port, Window w)
+{
+  KeystrokeQuery *q;
+  if (nkeystroke_queries == keystroke_queries_capacity) {
+    keystroke_queries_capacity =
+      (keystroke_queries_capacity ? keystroke_queries_capacity * 2 : 64);
+    xwREARRAY(keystroke_queries, KeystrokeQuery,
+	      keystroke_queries_capacity);
+  }
+  q = &keystroke_queries[nkeystroke_queries++];
+  q->port = port;
+  q->w = w;
+  q->class_hint = 0;
+  q->peer = None;
+  q->has_attributes = q->has_class_hint = 0;
+}
+
+
+/* query_keystroke_batch() sends the three queries for each of 'nq' windows
+   and fills in their KeystrokeQuery results with one round trip. Xlib has no
+   public way to have several replies outstanding at once, so this is the one
+   place xwrits uses Xlib's private interface (Xlibint.h). It relies on these
+   libX11 behaviors:
+
+   - GetReq/GetResReq append a request to the output buffer while the display
+     is locked, and NextRequest gives its sequence number in advance.
+   - A reply that no caller is waiting for is offered to each handler on
+     dpy->async_handlers in turn, with dpy->last_request_read already set to
+     the reply's full sequence number. A handler that returns True consumes
+     the reply. _XGetAsyncReply and _XGetAsyncData copy the reply out of
+     Xlib's buffer.
+   - XSync's round trip reads every earlier reply before it returns, so the
+     handler can be dequeued with DeqAsyncHandler afterward.
+
+   XCB cookies would do the same job publicly, but that needs
+   Xlib-xcb.h and libX11-xcb, which this build doesn't require. */
+
+typedef struct {
+  KeystrokeQuery *q;
+  int nq;
+  unsigned long first_request;
+} KeystrokeBatch;
+
+static Bool
+keystroke_batch_handler(Display *display, xReply *rep, char *buf, int len,
+			XPointer data)
+{
+  KeystrokeBatch *kb = (KeystrokeBatch *)data;
+  unsigned long offset = display->last_request_read - kb->first_request;
+  KeystrokeQuery *q;
+
+  if (offset >= (unsigned long)kb->nq * KEYSTROKE_QUERY_REQUESTS
+      || rep->generic.type != X_Reply)
+    return False;
+  q = &kb->q[offset / KEYSTROKE_QUERY_REQUESTS];
+
+  if (offset % KEYSTROKE_QUERY_REQUESTS == 0) {
+    xGetWindowAttributesReply replbuf, *r;
+    r = (xGetWindowAttributesReply *)
+      _XGetAsyncReply(display, (char *)&replbuf, rep, buf, len,
+		      (SIZEOF(xGetWindowAttributesReply) - SIZEOF(xReply)) >> 2,
+		      True);
+    q->event_masks = r->allEventMasks | r->doNotPropagateMask;
+    q->has_attributes = 1;
+
+  } else {
+    xGetPropertyReply replbuf, *r;
+    int is_class_hint = (offset % KEYSTROKE_QUERY_REQUESTS == 1);
+    int nbytes = 0;
+    r = (xGetPropertyReply *)
+      _XGetAsyncReply(display, (char *)&replbuf, rep, buf, len, 0, False);
+    if (is_class_hint && r->propertyType == XA_STRING && r->format == 8) {
+      nbytes = r->nItems;
+      if (nbytes > (int)(r->length << 2))
+	nbytes = r->length << 2;
+      q->class_hint = xwNEWARR(char, nbytes + 1);
+      _XGetAsyncData(display, q->class_hint, buf, len,
+		     SIZEOF(xGetPropertyReply), nbytes, r->length << 2);
+      q->class_hint[nbytes] = 0;
+      q->class_hint_len = nbytes;
+      q->has_class_hint = 1;
+    } else if (!is_class_hint && r->propertyType == XA_INTEGER
+	       && r->format == 32 && r->nItems >= 1) {
+      CARD32 peer;
+      _XGetAsyncData(display, (char *)&peer, buf, len,
+		     SIZEOF(xGetPropertyReply), 4, r->length << 2);
+      q->peer = peer;
+    } else
+      _XGetAsyncData(display, 0, buf, len,
+		     SIZEOF(xGetPropertyReply), 0, r->length << 2);
+  }
+
+  return True;
+}
+
+static void
+query_keystroke_batch(Port *port, KeystrokeQuery *q, int nq)
+{
+  Display *dpy = port->display;
+  _XAsyncHandler async;
+  KeystrokeBatch kb;
+  int i;
+
+  LockDisplay(dpy);
+  kb.q = q;
+  kb.nq = nq;
+  kb.first_request = NextRequest(dpy);
+  async.next = dpy->async_handlers;
+  async.handler = keystroke_batch_handler;
+  async.data = (XPointer)&kb;
+  dpy->async_handlers = &async;
+
+  for (i = 0; i < nq; i++) {
+    xResourceReq *req;
+    xGetPropertyReq *preq;
+    GetResReq(GetWindowAttributes, q[i].w, req);
+    /* XGetClassHint asks for BUFSIZ longs of WM_CLASS */
+    GetReq(GetProperty, preq);
+    preq->window = q[i].w;
+    preq->property = XA_WM_CLASS;
+    preq->type = XA_STRING;
+    preq->delete = False;
+    preq->longOffset = 0;
+    preq->longLength = BUFSIZ;
+    GetReq(GetProperty, preq);
+    preq->window = q[i].w;
+    preq->property = port->xwrits_window_atom;
+    preq->type = XA_INTEGER;
+    preq->delete = False;
+    preq->longOffset = 0;
+    preq->longLength = 1;
+  }
+  UnlockDisplay(dpy);
+
+  /* one round trip collects every reply */
+  XSync(dpy, False);
+
+  LockDisplay(dpy);
+  DeqAsyncHandler(dpy, &async);
+  UnlockDisplay(dpy);
+}
+
+static void
+finish_register_keystrokes(KeystrokeQuery *q)
 {
   /* Before I only selected KeyPress if someone else had selected KeyPress on
      the window (indicated by the 'or' of all_event_masks and
@@ -93,42 +284,489 @@ register_keystrokes(Port *port, Window w)
      many window manager windows which otherwise we would select events on,
      and not selecting events on 'em would seem to help performance. */
 
-  XWindowAttributes attr;
-  XClassHint class;
-  Window peer;
+  Port *port = q->port;
+  Window w = q->w;
+  const char *res_class;
 
-  if (XGetWindowAttributes(port->display, w, &attr) == 0)
+  if (!q->has_attributes || !q->has_class_hint)
     return;
 
-  if (XGetClassHint(port->display, w, &class) == 0)
-      return;
+  /* WM_CLASS is "name\0class\0" */
+  res_class = q->class_hint + strlen(q->class_hint);
+  if (res_class - q->class_hint < q->class_hint_len)
+    res_class++;
 
   /* check if this is an xwrits window */
-  peer = check_xwrits_window(port, w);
-  if (peer)
-    add_peer(port, peer);
+  if (q->peer)
+    add_peer(port, q->peer);
 
-  if (attr.root == w
-      || ((attr.all_event_masks | attr.do_not_propagate_mask)
-	  & (KeyPressMask | KeyReleaseMask))) {
+  if (w == port->root_window
+      || (q->event_masks & (KeyPressMask | KeyReleaseMask))) {
     key_press_selected_count++;
-    XSelectInput(port->display, w, SubstructureNotifyMask | KeyPressMask);
+    XSelectInput(port->display, w, SubstructureNotifyMask | KeyPressMask
+		 | (w == port->root_window ? port->root_event_mask : 0));
     if (verbose)
       fprintf(stderr, "Window 0x%x: (%s) listening for keystrokes\n", 
-              (unsigned)w, class.res_class);
+              (unsigned)w, res_class);
   } else if (verbose)
     fprintf(stderr, "Window 0x%x: (%s) skipping keystrokes\n", 
-            (unsigned)w, class.res_class );
+            (unsigned)w, res_class);
+}
+
+static void
+flush_register_keystrokes(void)
+{
+  int i, j, done = 0, n = nkeystroke_queries;
+
+  /* gather each port's queries together, then query them in one pass */
+  for (i = 0; i < nports && done < n; i++) {
+    Port *port = ports[i];
+    int first = done;
+    for (j = done; j < n; j++)
+      if (keystroke_queries[j].port == port) {
+	KeystrokeQuery tmp = keystroke_queries[j];
+	keystroke_queries[j] = keystroke_queries[done];
+	keystroke_queries[done++] = tmp;
+      }
+    if (done > first)
+      query_keystroke_batch(port, keystroke_queries + first, done - first);
+  }
+
+  for (i = 0; i < done; i++) {
+    finish_register_keystrokes(&keystroke_queries[i]);
+    xfree(keystroke_queries[i].class_hint);
+  }
+  nkeystroke_queries = 0;
+}
+
+
+/* XInput2 raw events. Selected once on the root window, they report every
+   key press, button press, and pointer motion on the display, so there is no
+   need to crawl the window tree or poll the pointer. */
+
+Xwtime mouse_grace_time;
+
+#define RAW_KEY			1
+#define RAW_MOTION		2
+
+int
+watch_raw_input(Port *port)
+{
+#ifdef HAVE_XI2
+  int opcode, event, error, major = 2, minor = 1;
+  unsigned char bits[XIMaskLen(XI_LASTEVENT)];
+  XIEventMask mask;
+  int i;
+
+  /* raw events aren't per screen: one selection serves the whole display */
+  for (i = 0; i < nports; i++)
+    if (ports[i] != port && ports[i]->display == port->display
+	&& ports[i]->xi2_opcode) {
+      port->xi2_opcode = ports[i]->xi2_opcode;
+      return 1;
+    }
+
+  /* XInput 2.1 delivers raw events even while another client has a grab */
+  if (!XQueryExtension(port->display, "XInputExtension", &opcode, &event,
+		       &error)
+      || XIQueryVersion(port->display, &major, &minor) != Success
+      || major < 2)
+    return 0;
+
+  memset(bits, 0, sizeof(bits));
+  XISetMask(bits, XI_RawKeyPress);
+  XISetMask(bits, XI_RawButtonPress);
+  if (check_mouse)
+    XISetMask(bits, XI_RawMotion);
+  mask.deviceid = XIAllMasterDevices;
+  mask.mask_len = sizeof(bits);
+  mask.mask = bits;
+  XISelectEvents(port->display, port->root_window, &mask, 1);
+
+  port->xi2_opcode = opcode;
+  port->xi2_activity = 0;
+  port->xi2_key_time = port->xi2_motion_time = CurrentTime;
+  port->xi2_motion_x = port->xi2_motion_y = 0;
+  if (verbose)
+    fprintf(stderr, "%s: using XInput %d.%d raw events\n",
+	    port->display_name, major, minor);
+  return 1;
+#else
+  (void) port;
+  return 0;
+#endif
+}
+
+#ifdef HAVE_XI2
+
+static Port *
+raw_input_port(Display *display)
+{
+  int i;
+  for (i = 0; i < nports; i++)
+    if (ports[i]->display == display && ports[i]->xi2_opcode)
+      return ports[i];
+  return 0;
+}
+
+static void
+raw_motion(Port *port, XIRawEvent *re)
+{
+  const double *v = re->raw_values;
+  Time window = xwTIMEMSEC(check_mouse_time);
+  int i;
+
+  /* like the A_MOUSE poll, only count movement within check_mouse_time */
+  if (re->time - port->xi2_motion_time > window) {
+    port->xi2_motion_time = re->time;
+    port->xi2_motion_x = port->xi2_motion_y = 0;
+  }
+
+  /* raw_values holds only the valuators set in the mask; X and Y are
+     valuators 0 and 1 */
+  for (i = 0; i < 2 && i < re->valuators.mask_len * 8; i++)
+    if (XIMaskIsSet(re->valuators.mask, i)) {
+      if (i == 0)
+	port->xi2_motion_x += *v;
+      else
+	port->xi2_motion_y += *v;
+      v++;
+    }
+
+  if (port->xi2_motion_x < -mouse_sensitivity
+      || port->xi2_motion_x > mouse_sensitivity
+      || port->xi2_motion_y < -mouse_sensitivity
+      || port->xi2_motion_y > mouse_sensitivity) {
+    port->xi2_activity |= RAW_MOTION;
+    port->xi2_motion_time = re->time;
+    port->xi2_motion_x = port->xi2_motion_y = 0;
+  }
+}
+
+/* Returns 1 if the event was a raw event, which needs no further
+   processing. Raw activity is only recorded here; loopmaster reports it once
+   per pass, after all queued events have been read. */
+static int
+watch_raw_event(Port *port, XEvent *e)
+{
+  XGenericEventCookie *cookie = &e->xcookie;
+  Port *xport = raw_input_port(port->display);
+
+  if (e->type == KeyPress || e->type == ButtonPress) {
+    /* The server sends the raw event just before the core event. If the core
+       event came to one of our windows, the x_looper sees it directly; don't
+       count the keystroke twice. */
+    Time t = (e->type == KeyPress ? e->xkey.time : e->xbutton.time);
+    if (t == xport->xi2_key_time)
+      xport->xi2_activity &= ~RAW_KEY;
+    return 0;
+  } else if (e->type != GenericEvent || cookie->extension != port->xi2_opcode)
+    return 0;
+
+  if (XGetEventData(port->display, cookie)) {
+    XIRawEvent *re = (XIRawEvent *)cookie->data;
+    if (cookie->evtype == XI_RawMotion)
+      raw_motion(xport, re);
+    else if (cookie->evtype == XI_RawKeyPress
+	     || cookie->evtype == XI_RawButtonPress) {
+      xport->xi2_key_time = re->time;
+      xport->xi2_activity |= RAW_KEY;
+    }
+    XFreeEventData(port->display, cookie);
+  }
+  return 1;
+}
+
+static int
+raw_input_activity(Port *port, const Xwtime *now)
+{
+  int activity = port->xi2_activity;
+  port->xi2_activity = 0;
+  /* give people a moment to jiggle the mouse at the start of a break */
+  if (xwTIMEGT(mouse_grace_time, *now))
+    activity &= ~RAW_MOTION;
+  return activity != 0;
+}
+
+#endif
+
+
+/* SYNC IDLETIME alarms. Instead of asking the X Screen Saver extension how
+   long the user has been idle every check_xss_time, have the server tell us
+   when IDLETIME rises past check_xss_time (idleness began) and when it drops
+   back (input resumed). While the user is active, A_XSS_CHECK still reports
+   activity every check_xss_time, but without a round trip; once every
+   display is idle, it stops, and xwrits sleeps until the server wakes it. */
+
+int
+watch_idle_time(Port *port)
+{
+#if defined(HAVE_XSS) && defined(HAVE_XSYNC)
+  Display *display = port->display;
+  int event_base, error_base, major, minor, ncounters, i;
+  XSyncSystemCounter *counters;
+  XSyncCounter idletime = None;
+  XSyncAlarmAttributes attr;
+  unsigned long flags;
+
+  /* IDLETIME is per display: one pair of alarms serves every screen */
+  for (i = 0; i < nports; i++)
+    if (ports[i] != port && ports[i]->display == display
+	&& ports[i]->idle_alarm) {
+      port->sync_event_base = ports[i]->sync_event_base;
+      return 1;
+    }
+
+  if (!XSyncQueryExtension(display, &event_base, &error_base)
+      || !XSyncInitialize(display, &major, &minor))
+    return 0;
+  counters = XSyncListSystemCounters(display, &ncounters);
+  for (i = 0; i < ncounters; i++)
+    if (strcmp(counters[i].name, "IDLETIME") == 0)
+      idletime = counters[i].counter;
+  if (counters)
+    XSyncFreeSystemCounterList(counters);
+  if (idletime == None)
+    return 0;
+
+  /* transition alarms with zero delta stay armed after they fire */
+  attr.trigger.counter = idletime;
+  attr.trigger.value_type = XSyncAbsolute;
+  XSyncIntToValue(&attr.trigger.wait_value,
+		  xwTIMEMSEC(check_xss_time));
+  XSyncIntToValue(&attr.delta, 0);
+  attr.events = True;
+  flags = XSyncCACounter | XSyncCAValueType | XSyncCAValue | XSyncCATestType
+    | XSyncCADelta | XSyncCAEvents;
+  attr.trigger.test_type = XSyncPositiveTransition;
+  port->idle_alarm = XSyncCreateAlarm(display, flags, &attr);
+  attr.trigger.test_type = XSyncNegativeTransition;
+  port->active_alarm = XSyncCreateAlarm(display, flags, &attr);
+
+  /* somebody just started us, so assume the user is active */
+  port->sync_event_base = event_base;
+  port->idle = 0;
+  if (verbose)
+    fprintf(stderr, "%s: using SYNC IDLETIME alarms\n", port->display_name);
+  return 1;
+#else
+  (void) port;
+  return 0;
+#endif
+}
+
+#if defined(HAVE_XSS) && defined(HAVE_XSYNC)
+
+/* Returns 1 if the event was an IDLETIME alarm that needs no further
+   processing. An alarm reporting renewed input is turned into a skeletal
+   MotionNotify, just like the A_XSS_CHECK report. */
+static int
+idle_alarm_event(Port *port, XEvent *e, const Xwtime *now)
+{
+  XSyncAlarmNotifyEvent *ae = (XSyncAlarmNotifyEvent *)e;
+  Alarm *a;
+  int i;
+
+  if (e->type != port->sync_event_base + XSyncAlarmNotify)
+    return 0;
+
+  for (i = 0; i < nports; i++)
+    if (ports[i]->display == port->display && ports[i]->idle_alarm)
+      break;
+  if (i == nports)
+    return 1;
+  port = ports[i];
+
+  if (ae->alarm == port->idle_alarm) {
+    port->idle = 1;
+    return 1;
+  } else if (ae->alarm != port->active_alarm)
+    return 1;
+
+  /* input resumed: report it, and restart A_XSS_CHECK if it had stopped */
+  port->idle = 0;
+  if (!(a = grab_alarm_data(A_XSS_CHECK, 0, 0))) {
+    a = new_alarm(A_XSS_CHECK);
+    xwADDTIME(a->timer, *now, check_xss_time);
+  }
+  schedule(a);
+  e->type = MotionNotify;
+  return 0;
+}
+
+#endif
+
+
+/*****************************************************************************/
+/*  Time								     */
+
+/* CLOCK_BOOTTIME keeps counting during suspend, which should count as a
+   break; CLOCK_MONOTONIC doesn't. Neither jumps when the wall clock is set.
+   The wakeup timer uses the same clock. */
+
+#ifdef HAVE_CLOCK_GETTIME
+# ifdef CLOCK_BOOTTIME
+static clockid_t xwclock_id = CLOCK_BOOTTIME;
+# else
+static clockid_t xwclock_id = CLOCK_MONOTONIC;
+# endif
+#endif
+
+Xwtime
+xwclock(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+  struct timespec ts;
+  if (clock_gettime(xwclock_id, &ts) != 0) {
+    xwclock_id = CLOCK_MONOTONIC;
+    clock_gettime(xwclock_id, &ts);
+  }
+  return (Xwtime)ts.tv_sec * NANO_PER_SEC + ts.tv_nsec;
+#else
+  struct timeval tv;
+  xwGETTIMEOFDAY(&tv);
+  return (Xwtime)tv.tv_sec * NANO_PER_SEC + (Xwtime)tv.tv_usec * NANO_PER_USEC;
+#endif
 }
 
 
 /*****************************************************************************/
 /*  Scheduling and alarm functions					     */
 
+#define ALARM_BEFORE(a, b) (xwTIMEGT((b)->timer, (a)->timer) || \
+	((a)->timer == (b)->timer && (a)->sequence < (b)->sequence))
+
+static int
+action_slot(int action)
+{
+  int slot = 0;
+  while (action > 1 && slot < NACTIONS - 1)
+    action >>= 1, slot++;
+  return slot;
+}
+
+static unsigned
+alarm_hash(int action, void *data1)
+{
+  unsigned long h =
+    ((unsigned long)data1 ^ (unsigned long)action) * 0x9E3779B1UL;
+  h ^= h >> 16;
+  return (unsigned)h & (alarm_nbuckets - 1);
+}
+
+static void
+hash_alarm(Alarm *a)
+{
+  Alarm **bucket = &alarm_buckets[alarm_hash(a->action, a->data1)];
+  a->hash_next = *bucket;
+  a->hash_pprev = bucket;
+  if (*bucket)
+    (*bucket)->hash_pprev = &a->hash_next;
+  *bucket = a;
+}
+
+static void
+unhash_alarm(Alarm *a)
+{
+  *a->hash_pprev = a->hash_next;
+  if (a->hash_next)
+    a->hash_next->hash_pprev = a->hash_pprev;
+}
+
+static void
+rehash_alarms(unsigned nbuckets)
+{
+  int i;
+  xfree(alarm_buckets);
+  alarm_nbuckets = nbuckets;
+  alarm_buckets = xwNEWARR(Alarm *, nbuckets);
+  memset(alarm_buckets, 0, sizeof(Alarm *) * nbuckets);
+  for (i = 0; i < nalarms; i++)
+    hash_alarm(alarm_heap[i]);
+}
+
+static void
+sift_up(int i)
+{
+  Alarm *a = alarm_heap[i];
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!ALARM_BEFORE(a, alarm_heap[parent]))
+      break;
+    alarm_heap[i] = alarm_heap[parent];
+    alarm_heap[i]->heap_index = i;
+    i = parent;
+  }
+  alarm_heap[i] = a;
+  a->heap_index = i;
+}
+
+static void
+sift_down(int i)
+{
+  Alarm *a = alarm_heap[i];
+  while (1) {
+    int child = 2 * i + 1;
+    if (child >= nalarms)
+      break;
+    if (child + 1 < nalarms
+	&& ALARM_BEFORE(alarm_heap[child + 1], alarm_heap[child]))
+      child++;
+    if (!ALARM_BEFORE(alarm_heap[child], a))
+      break;
+    alarm_heap[i] = alarm_heap[child];
+    alarm_heap[i]->heap_index = i;
+    i = child;
+  }
+  alarm_heap[i] = a;
+  a->heap_index = i;
+}
+
+/* remove a scheduled alarm from the heap and the index */
+static void
+remove_alarm(Alarm *a)
+{
+  int i = a->heap_index;
+  assert(a->scheduled && alarm_heap[i] == a);
+  unhash_alarm(a);
+  alarm_action_count[action_slot(a->action)]--;
+  a->scheduled = 0;
+  nalarms--;
+  if (i < nalarms) {
+    alarm_heap[i] = alarm_heap[nalarms];
+    alarm_heap[i]->heap_index = i;
+    if (i > 0 && ALARM_BEFORE(alarm_heap[i], alarm_heap[(i - 1) / 2]))
+      sift_up(i);
+    else
+      sift_down(i);
+  }
+}
+
+
+/* Periodic alarms may fire a little late, so one wakeup can serve several
+   of them. Flashing stays within a frame; the clock, which rounds to the
+   nearest second, and the idle polls can wait longer. */
+static Xwtime
+default_slack(int action)
+{
+  switch (action) {
+   case A_FLASH:
+    return 10 * (Xwtime)NANO_PER_MSEC;
+   case A_CLOCK:
+    return 100 * (Xwtime)NANO_PER_MSEC;
+   case A_MOUSE:
+   case A_XSS_CHECK:
+    return 500 * (Xwtime)NANO_PER_MSEC;
+   default:
+    return 0;
+  }
+}
+
 Alarm *
 new_alarm_data(int action, void *data1, void *data2)
 {
   Alarm *a = xwNEW(Alarm);
+  a->slack = default_slack(action);
   a->action = action;
   a->data1 = data1;
   a->data2 = data2;
@@ -140,11 +778,9 @@ Alarm *
 grab_alarm_data(int action, void *data1, void *data2)
 {
   Alarm *a;
-  for (a = alarm_sentinel.next; a != &alarm_sentinel; a = a->next)
+  for (a = alarm_buckets[alarm_hash(action, data1)]; a; a = a->hash_next)
     if (a->action == action && a->data1 == data1 && a->data2 == data2) {
-      a->prev->next = a->next;
-      a->next->prev = a->prev;
-      a->scheduled = 0;
+      remove_alarm(a);
       return a;
     }
   return 0;
@@ -153,10 +789,8 @@ grab_alarm_data(int action, void *data1, void *data2)
 void
 destroy_alarm(Alarm *a)
 {
-  if (a->scheduled) {
-    a->prev->next = a->next;
-    a->next->prev = a->prev;
-  }
+  if (a->scheduled)
+    remove_alarm(a);
   xfree(a);
 }
 
@@ -164,39 +798,232 @@ destroy_alarm(Alarm *a)
 void
 init_scheduler(void)
 {
-  alarm_sentinel.next = alarm_sentinel.prev = &alarm_sentinel;
+  nalarms = 0;
+  alarm_heap_capacity = 64;
+  alarm_heap = xwNEWARR(Alarm *, alarm_heap_capacity);
+  rehash_alarms(64);
 }
 
 void
 schedule(Alarm *newalarm)
 {
-  Alarm *a = alarm_sentinel.prev;
   assert(!newalarm->scheduled);
-  while (a != &alarm_sentinel && xwTIMEGT(a->timer, newalarm->timer))
-    a = a->prev;
-  newalarm->prev = a;
-  newalarm->next = a->next;
-  a->next->prev = newalarm;
-  a->next = newalarm;
+  if (nalarms == alarm_heap_capacity) {
+    alarm_heap_capacity *= 2;
+    xwREARRAY(alarm_heap, Alarm *, alarm_heap_capacity);
+  }
+  newalarm->sequence = alarm_sequence++;
   newalarm->scheduled = 1;
+  alarm_heap[nalarms++] = newalarm;
+  sift_up(nalarms - 1);
+  alarm_action_count[action_slot(newalarm->action)]++;
+  if ((unsigned)nalarms > alarm_nbuckets)
+    rehash_alarms(alarm_nbuckets * 2);
+  else
+    hash_alarm(newalarm);
 }
 
 void
 unschedule_data(int actions, void *data1)
 {
-  Alarm *a = alarm_sentinel.next;
-  while (a != &alarm_sentinel) {
-    Alarm *n = a->next;
+  int slot, i, j;
+
+  if (data1) {
+    /* one index lookup per requested action */
+    for (slot = 0; slot < NACTIONS; slot++)
+      if ((actions & (1 << slot)) && alarm_action_count[slot]) {
+	int action = 1 << slot;
+	Alarm *a = alarm_buckets[alarm_hash(action, data1)];
+	while (a) {
+	  Alarm *n = a->hash_next;
+	  if (a->action == action && a->data1 == data1) {
+	    remove_alarm(a);
+	    xfree(a);
+	  }
+	  a = n;
+	}
+      }
+    return;
+  }
+
+  /* data1 == 0 matches every alarm of the given actions; skip the walk if
+     there aren't any */
+  for (slot = 0; slot < NACTIONS; slot++)
+    if ((actions & (1 << slot)) && alarm_action_count[slot])
+      break;
+  if (slot == NACTIONS)
+    return;
 
-    if ((a->action & actions) != 0 && (a->data1 == data1 || data1 == 0)) {
-      a->prev->next = n;
-      n->prev = a->prev;
+  /* compact the heap, then restore the heap property */
+  for (i = j = 0; i < nalarms; i++) {
+    Alarm *a = alarm_heap[i];
+    if (a->action & actions) {
+      unhash_alarm(a);
+      alarm_action_count[action_slot(a->action)]--;
+      a->scheduled = 0;
       xfree(a);
+    } else {
+      alarm_heap[j] = a;
+      a->heap_index = j++;
+    }
+  }
+  nalarms = j;
+  for (i = nalarms / 2 - 1; i >= 0; i--)
+    sift_down(i);
+}
+
+
+/* Return the time of the next wakeup: the earliest timer + slack of any
+   alarm. Every alarm due by then fires in that wakeup. The heap is ordered
+   by timer, so subtrees whose timers come after the best time so far can't
+   improve it. */
+
+static void
+wakeup_search(int i, Xwtime *best)
+{
+  Alarm *a;
+  if (i >= nalarms || xwTIMEGEQ(alarm_heap[i]->timer, *best))
+    return;
+  a = alarm_heap[i];
+  if (a->timer + a->slack < *best)
+    *best = a->timer + a->slack;
+  wakeup_search(2 * i + 1, best);
+  wakeup_search(2 * i + 2, best);
+}
+
+static Xwtime
+wakeup_time(void)
+{
+  Xwtime best = alarm_heap[0]->timer + alarm_heap[0]->slack;
+  wakeup_search(1, &best);
+  wakeup_search(2, &best);
+  return best;
+}
+
+
+/*****************************************************************************/
+/*  Waiting for events							     */
+
+/* loopmaster waits on every X connection, and on any other descriptor handed
+   to watch_fd, with a single poll(). Each connection appears once, however
+   many Ports share it, and is read only when poll() says it's readable. */
+
+typedef struct {
+  Port *port;			/* first Port on an X connection, or 0 */
+  Fdloopfunc func;		/* callback for other descriptors */
+  void *thunk;
+} FdWatch;
+
+static struct pollfd *pollfds;
+static FdWatch *fdwatches;
+static int nfdwatches;
+static int fdwatches_capacity;
+
+static int
+add_fdwatch(int fd)
+{
+  int i;
+  for (i = 0; i < nfdwatches; i++)
+    if (pollfds[i].fd == fd)
+      return i;
+  if (nfdwatches == fdwatches_capacity) {
+    fdwatches_capacity = (fdwatches_capacity ? fdwatches_capacity * 2 : 8);
+    xwREARRAY(pollfds, struct pollfd, fdwatches_capacity);
+    xwREARRAY(fdwatches, FdWatch, fdwatches_capacity);
+  }
+  pollfds[i].fd = fd;
+  pollfds[i].events = POLLIN;
+  pollfds[i].revents = 0;
+  fdwatches[i].port = 0;
+  fdwatches[i].func = 0;
+  fdwatches[i].thunk = 0;
+  nfdwatches++;
+  return i;
+}
+
+void
+watch_display(Port *port)
+{
+  int i = add_fdwatch(port->x_socket);
+  if (!fdwatches[i].port)
+    fdwatches[i].port = port;
+}
+
+void
+watch_fd(int fd, Fdloopfunc func, void *thunk)
+{
+  int i = add_fdwatch(fd);
+  assert(!fdwatches[i].port);
+  fdwatches[i].func = func;
+  fdwatches[i].thunk = thunk;
+}
+
+void
+unwatch_fd(int fd)
+{
+  int i;
+  for (i = 0; i < nfdwatches; i++)
+    if (pollfds[i].fd == fd && !fdwatches[i].port) {
+      nfdwatches--;
+      pollfds[i] = pollfds[nfdwatches];
+      fdwatches[i] = fdwatches[nfdwatches];
+      return;
     }
+}
+
+static int
+timeout_msec(const Xwtime *timeout)
+{
+  /* round up, so we never wake just before an alarm is due */
+  return xwTIMEMSEC(*timeout + NANO_PER_MSEC - 1);
+}
+
+/* Where available, a timerfd armed at the absolute wakeup time replaces the
+   poll() timeout, so wakeups aren't rounded to milliseconds. */
+
+#ifdef USE_TIMERFD
+static int wakeup_fd = -1;
+static Xwtime wakeup_armed = -1;
 
-    a = n;
+static void
+drain_wakeup_fd(int fd, void *thunk)
+{
+  uint64_t expirations;
+  (void) thunk;
+  if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    expirations = 0;
+  wakeup_armed = -1;
+}
+
+static void
+init_wakeup_fd(void)
+{
+  wakeup_fd = timerfd_create(xwclock_id, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (wakeup_fd >= 0)
+    watch_fd(wakeup_fd, drain_wakeup_fd, 0);
+}
+
+/* arm the timer for 'when', or disarm it if 'when' is negative */
+static int
+arm_wakeup_fd(Xwtime when)
+{
+  struct itimerspec its;
+  if (when == wakeup_armed)
+    return 1;
+  memset(&its, 0, sizeof(its));
+  if (when >= 0) {
+    Xwtime abs = when + genesis_time;
+    its.it_value.tv_sec = xwTIMESEC(abs);
+    its.it_value.tv_nsec = abs % NANO_PER_SEC;
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+      its.it_value.tv_nsec = 1;
   }
+  if (timerfd_settime(wakeup_fd, TFD_TIMER_ABSTIME, &its, 0) < 0)
+    return 0;
+  wakeup_armed = when;
+  return 1;
 }
+#endif
 
 void
 looprinter(int i, int ret_val)
@@ -229,9 +1056,8 @@ looprinter(int i, int ret_val)
 int
 loopmaster(Alarmloopfunc alarm_looper, Xloopfunc x_looper)
 {
-  struct timeval timeout, now, *timeoutptr;
-  fd_set xfds;
-  int pending, i;
+  Xwtime timeout, now;
+  int pending, wait_msec, i;
   int ret_val = 0;
 
   /* 26 May 1998: Changed logic to avoid race conditions. Now we always flush
@@ -241,21 +1067,23 @@ loopmaster(Alarmloopfunc alarm_looper, Xloopfunc x_looper)
      to gifview, which exercised this code more strenuously. */
 
   xwGETTIME(now);
-  FD_ZERO(&xfds);
+
+#ifdef USE_TIMERFD
+  if (wakeup_fd < 0)
+    init_wakeup_fd();
+#endif
 
   while (1) {
     while (1) {
-      Alarm *a = alarm_sentinel.next;
+      Alarm *a = (nalarms ? alarm_heap[0] : 0);
       Hand *h;
       Gif_Stream *gfs;
 
-      if (a == &alarm_sentinel || xwTIMEGT(a->timer, now))
+      if (!a || xwTIMEGT(a->timer, now))
 	break;
 
       h = (Hand *)a->data1;
-      alarm_sentinel.next = a->next;
-      a->next->prev = &alarm_sentinel;
-      a->scheduled = 0;
+      remove_alarm(a);
 
       switch (a->action) {
 
@@ -287,7 +1115,12 @@ loopmaster(Alarmloopfunc alarm_looper, Xloopfunc x_looper)
 	ret_val = TRAN_AWAKE;
 	break;
 
+       case A_PRERENDER:
+	prerender_slide(a, &now);
+	break;
+
        case A_IDLE_SELECT:
+	/* queued; see flush_register_keystrokes */
 	register_keystrokes((Port *)a->data2, (Window)a->data1);
 	break;
 
@@ -297,7 +1130,7 @@ loopmaster(Alarmloopfunc alarm_looper, Xloopfunc x_looper)
 	 unsigned mask;
 	 int i;
 	 for (i = 0; i < nports; i++) {
-	   if (ports[i]->master != ports[i])
+	   if (ports[i]->master != ports[i] || ports[i]->xi2_opcode)
 	     continue;
 	   XQueryPointer(ports[i]->display, ports[i]->root_window, &root,
 			 &child, &root_x, &root_y, &win_x, &win_y, &mask);
@@ -323,16 +1156,25 @@ loopmaster(Alarmloopfunc alarm_looper, Xloopfunc x_looper)
 #ifdef HAVE_XSS
        case A_XSS_CHECK: {
      static XScreenSaverInfo* mitInfo = 0;
-     int idle_break = 0;
+     int idle_break = 0, polling = 0;
 
      if (!mitInfo) mitInfo = XScreenSaverAllocInfo ();
 
 	 for (i = 0; i < nports; i++) {
 	   if (ports[i]->master != ports[i])
 	     continue;
+	   if (ports[i]->sync_event_base) {
+	     /* no IDLETIME alarm since the last input: still active */
+	     if (ports[i]->idle_alarm && !ports[i]->idle) {
+	       idle_break++;
+	       polling++;
+	     }
+	     continue;
+	   }
+	   polling++;
        /* xautolock uses QueryInfo therefore I hope it's a performant one :) */
        XScreenSaverQueryInfo (ports[i]->display, ports[i]->root_window, mitInfo);
-       if( mitInfo->idle < check_xss_time.tv_sec * 1000 )
+       if( mitInfo->idle < (unsigned long)xwTIMESEC(check_xss_time) * 1000 )
            idle_break++;
      }
      if ( x_looper && idle_break ) { /* we break on ANY port xss idle detection */
@@ -340,13 +1182,19 @@ loopmaster(Alarmloopfunc alarm_looper, Xloopfunc x_looper)
        event.type = MotionNotify; /* we use skeletal MotionNotify as a XSS signal */
        ret_val = x_looper(&event, &now);
      }
-     // reschedule
-	 xwADDTIME(a->timer, a->timer, check_xss_time);
-	 schedule(a);
+     // reschedule, unless every display is idle; see idle_alarm_event
+	 if (polling) {
+	   xwADDTIME(a->timer, a->timer, check_xss_time);
+	   schedule(a);
+	 }
 	 break;
        }
 #endif
 
+       case A_RAISE:
+	deferred_raise(a, &now);
+	break;
+
        default:
 	if (alarm_looper)
 	  ret_val = alarm_looper(a, &now);
@@ -356,45 +1204,71 @@ loopmaster(Alarmloopfunc alarm_looper, Xloopfunc x_looper)
 
       if (!a->scheduled) xfree(a);
       if (ret_val != 0) {
+        if (nkeystroke_queries)
+          flush_register_keystrokes();
         looprinter(1, ret_val);
         return ret_val;
       }
     }
 
-    if (alarm_sentinel.next != &alarm_sentinel) {
-      timeoutptr = &timeout;
-      xwSUBTIME(timeout, alarm_sentinel.next->timer, now);
-    } else
-      timeoutptr = 0;
-
-    for (i = pending = 0; !pending && i < nports; i++)
-      pending = XPending(ports[i]->display);
-    if (!pending) {
-      int result;
-      xfds = x_socket_set;
-      result = select(max_x_socket + 1, &xfds, 0, 0, timeoutptr);
-    }
+    /* register keystrokes on all windows whose A_IDLE_SELECT came due */
+    if (nkeystroke_queries)
+      flush_register_keystrokes();
 
-    /* Behave robustly when the system clock is adjusted backwards. The idea:
-       estimate the duration of the backwards jump and subtract that from
-       genesis_time. This will compensate for the jump in any new times
-       returned from xwGETTIME. */
-    {
-      struct timeval new_now;
-      xwGETTIME(new_now);
-      if (xwTIMEGT(now, new_now)) {
-	xwSUBTIME(new_now, now, new_now);
-	xwSUBTIME(genesis_time, genesis_time, new_now);
-	xwGETTIME(new_now);
+    /* Flush every connection; don't block if events are already queued. */
+    for (i = pending = 0; i < nfdwatches; i++)
+      if (fdwatches[i].port) {
+	Display *display = fdwatches[i].port->display;
+	XFlush(display);
+	if (XEventsQueued(display, QueuedAlready))
+	  pending = 1;
       }
-      now = new_now;
+
+    if (pending)
+      wait_msec = 0;
+    else if (nalarms) {
+      xwSUBTIME(timeout, wakeup_time(), now);
+      if (xwTIMELEQ0(timeout))
+	wait_msec = 0;
+#ifdef USE_TIMERFD
+      else if (wakeup_fd >= 0 && arm_wakeup_fd(now + timeout))
+	wait_msec = -1;
+#endif
+      else
+	wait_msec = timeout_msec(&timeout);
+    } else {
+#ifdef USE_TIMERFD
+      if (wakeup_fd >= 0)
+	arm_wakeup_fd(-1);
+#endif
+      wait_msec = -1;
     }
 
-    /* Handle X events. */
-    for (i = 0; i < nports; i++)
-      while (XPending(ports[i]->display)) {
+    if (poll(pollfds, nfdwatches, wait_msec) < 0)
+      for (i = 0; i < nfdwatches; i++)
+	pollfds[i].revents = 0;
+
+    xwGETTIME(now);
+
+    /* Handle X events. Only read from connections poll() marked readable;
+       events queued by round trips elsewhere are handled too. */
+    for (i = 0; i < nfdwatches; i++) {
+      Port *port = fdwatches[i].port;
+      if (!port)
+	continue;
+      if (pollfds[i].revents)
+	XEventsQueued(port->display, QueuedAfterReading);
+      while (XEventsQueued(port->display, QueuedAlready)) {
 	XEvent event;
-	XNextEvent(ports[i]->display, &event);
+	XNextEvent(port->display, &event);
+#ifdef HAVE_XI2
+	if (port->xi2_opcode && watch_raw_event(port, &event))
+	  continue;
+#endif
+#if defined(HAVE_XSS) && defined(HAVE_XSYNC)
+	if (port->sync_event_base && idle_alarm_event(port, &event, &now))
+	  continue;
+#endif
 	default_x_processing(&event);
 	if (x_looper)
 	    ret_val = x_looper(&event, &now);
@@ -403,6 +1277,28 @@ loopmaster(Alarmloopfunc alarm_looper, Xloopfunc x_looper)
 	    return ret_val;
         }
       }
+    }
+
+    /* Handle other descriptors. Go backwards in case a callback unwatches
+       its own descriptor. */
+    for (i = nfdwatches - 1; i >= 0; i--)
+      if (!fdwatches[i].port && pollfds[i].revents)
+	fdwatches[i].func(pollfds[i].fd, fdwatches[i].thunk);
+
+#ifdef HAVE_XI2
+    /* report raw input once per pass, like the A_MOUSE poll */
+    for (i = 0; i < nports; i++)
+      if (ports[i]->xi2_activity && raw_input_activity(ports[i], &now)
+	  && x_looper) {
+	XEvent event;
+	event.type = MotionNotify; /* skeletal MotionNotify event */
+	ret_val = x_looper(&event, &now);
+	if (ret_val != 0) {
+	  looprinter(2, ret_val);
+	  return ret_val;
+	}
+      }
+#endif
   }
 }
 
@@ -0,0 +1,407 @@
+/* -*- c-basic-offset: 2 -*- */
+#include <config.h>
+#include "xwrits.h"
+#include <string.h>
+#include <X11/Xatom.h>
+
+/* With +top, an obscured hand checks whether another program's window is
+   stacked above it. Rather than asking the server for the window tree on
+   every VisibilityNotify, each master Port keeps a model of the root
+   window's children, bottom first, maintained from SubstructureNotify
+   events on the root. A window's geometry is fetched the first time it
+   matters and kept up to date from events after that. */
+
+struct StackWindow {
+  Window w;
+  int x;
+  int y;
+  int width;
+  int height;
+  unsigned known: 1;		/* geometry and map state are current */
+  unsigned mapped: 1;
+  unsigned xwrits: 1;		/* belongs to an xwrits process */
+};
+
+
+static int
+stack_find(Port *port, Window w)
+{
+  int i;
+  for (i = port->nstack - 1; i >= 0; i--)
+    if (port->stack[i].w == w)
+      return i;
+  return -1;
+}
+
+static StackWindow *
+stack_insert(Port *port, int pos, Window w)
+{
+  StackWindow *sw;
+  if (port->nstack == port->stack_capacity) {
+    port->stack_capacity = (port->stack_capacity ? port->stack_capacity * 2 : 64);
+    xwREARRAY(port->stack, StackWindow, port->stack_capacity);
+  }
+  sw = &port->stack[pos];
+  memmove(sw + 1, sw, sizeof(StackWindow) * (port->nstack - pos));
+  port->nstack++;
+  memset(sw, 0, sizeof(StackWindow));
+  sw->w = w;
+  return sw;
+}
+
+static void
+stack_remove(Port *port, int pos)
+{
+  port->nstack--;
+  memmove(&port->stack[pos], &port->stack[pos + 1],
+	  sizeof(StackWindow) * (port->nstack - pos));
+}
+
+/* move the window at 'from' so it sits just above 'below' (-1 = bottom) */
+static void
+stack_move(Port *port, int from, int below)
+{
+  StackWindow sw = port->stack[from];
+  if (below == from || below == from - 1)
+    return;
+  stack_remove(port, from);
+  if (below > from)
+    below--;
+  *stack_insert(port, below + 1, sw.w) = sw;
+}
+
+static int
+stack_fetch(Port *port, StackWindow *sw)
+{
+  XWindowAttributes attr;
+  if (!XGetWindowAttributes(port->display, sw->w, &attr))
+    return 0;
+  sw->x = attr.x;
+  sw->y = attr.y;
+  sw->width = attr.width;
+  sw->height = attr.height;
+  sw->mapped = (attr.map_state != IsUnmapped);
+  sw->known = 1;
+  return 1;
+}
+
+static void
+init_stack(Port *port)
+{
+  XWindowAttributes attr;
+  Window root, parent, *children = 0;
+  unsigned nchildren, i;
+
+  /* select events first, so no change after the query is missed; keep any
+     events the keystroke watcher has selected */
+  port->root_event_mask |= SubstructureNotifyMask;
+  if (XGetWindowAttributes(port->display, port->root_window, &attr))
+    XSelectInput(port->display, port->root_window,
+		 attr.your_event_mask | port->root_event_mask);
+  port->stack_tracked = 1;
+  port->nstack = 0;
+
+  if (XQueryTree(port->display, port->root_window, &root, &parent,
+		 &children, &nchildren))
+    for (i = 0; i < nchildren; i++)
+      stack_insert(port, port->nstack, children[i]);
+  if (children)
+    XFree(children);
+}
+
+
+void
+stack_event(XEvent *e)
+{
+  Port *port = 0;
+  StackWindow *sw;
+  int i, pos;
+
+  switch (e->type) {
+   case CreateNotify: case DestroyNotify: case ReparentNotify:
+   case ConfigureNotify: case GravityNotify: case CirculateNotify:
+   case MapNotify: case UnmapNotify:
+    break;
+   default:
+    return;
+  }
+
+  /* these events name the window they were selected on first */
+  for (i = 0; i < nports && !port; i++)
+    if (ports[i]->stack_tracked && ports[i]->display == e->xany.display
+	&& ports[i]->root_window == e->xany.window)
+      port = ports[i];
+  if (!port)
+    return;
+
+  switch (e->type) {
+
+   case CreateNotify:
+    if (stack_find(port, e->xcreatewindow.window) < 0) {
+      sw = stack_insert(port, port->nstack, e->xcreatewindow.window);
+      sw->x = e->xcreatewindow.x;
+      sw->y = e->xcreatewindow.y;
+      sw->width = e->xcreatewindow.width;
+      sw->height = e->xcreatewindow.height;
+      sw->known = 1;
+    }
+    break;
+
+   case DestroyNotify:
+    if ((pos = stack_find(port, e->xdestroywindow.window)) >= 0)
+      stack_remove(port, pos);
+    break;
+
+   case ReparentNotify:
+    pos = stack_find(port, e->xreparent.window);
+    if (e->xreparent.parent != port->root_window) {
+      if (pos >= 0)
+	stack_remove(port, pos);
+    } else if (pos < 0)
+      stack_insert(port, port->nstack, e->xreparent.window);
+    break;
+
+   case ConfigureNotify:
+    if ((pos = stack_find(port, e->xconfigure.window)) < 0)
+      break;
+    sw = &port->stack[pos];
+    sw->x = e->xconfigure.x;
+    sw->y = e->xconfigure.y;
+    sw->width = e->xconfigure.width;
+    sw->height = e->xconfigure.height;
+    if (e->xconfigure.above == None)
+      stack_move(port, pos, -1);
+    else if (pos == 0 || port->stack[pos - 1].w != e->xconfigure.above) {
+      int below = stack_find(port, e->xconfigure.above);
+      if (below >= 0)
+	stack_move(port, pos, below);
+    }
+    break;
+
+   case GravityNotify:
+    if ((pos = stack_find(port, e->xgravity.window)) >= 0) {
+      port->stack[pos].x = e->xgravity.x;
+      port->stack[pos].y = e->xgravity.y;
+    }
+    break;
+
+   case CirculateNotify:
+    if ((pos = stack_find(port, e->xcirculate.window)) >= 0)
+      stack_move(port, pos, (e->xcirculate.place == PlaceOnTop
+			     ? port->nstack - 1 : -1));
+    break;
+
+   case MapNotify:
+   case UnmapNotify:
+    if ((pos = stack_find(port, e->type == MapNotify
+			  ? e->xmap.window : e->xunmap.window)) >= 0)
+      port->stack[pos].mapped = (e->type == MapNotify);
+    break;
+
+  }
+}
+
+
+/* Is some other program's window stacked above 'h' and overlapping it? */
+int
+check_raise_window(Hand *h)
+{
+  Port *port = h->port;
+  StackWindow *sw;
+  Hand *trav;
+  int pos, hx, hy, hwidth, hheight;
+
+  if (!port->stack_tracked)
+    init_stack(port);
+
+  /* find our geometry and position in the stacking order */
+  if ((pos = stack_find(port, h->root_child)) < 0)
+    return 0;
+  sw = &port->stack[pos];
+  if (!sw->known && !stack_fetch(port, sw))
+    return 0;
+  hx = sw->x;
+  hy = sw->y;
+  hwidth = sw->width;
+  hheight = sw->height;
+
+  /* examine higher windows in the stacking order */
+  for (pos++; pos < port->nstack; pos++) {
+    sw = &port->stack[pos];
+    /* overlap by other hands is OK */
+    for (trav = port->hands; trav; trav = trav->next)
+      if (sw->w == trav->root_child)
+	break;
+    if (trav || sw->xwrits)
+      continue;
+    if (!sw->known && !stack_fetch(port, sw)) {
+      /* the window is gone */
+      stack_remove(port, pos);
+      pos--;
+      continue;
+    }
+    /* check to see that this window actually overlaps us */
+    if (!sw->mapped
+	|| sw->x > hx + hwidth || sw->y > hy + hheight
+	|| sw->x + sw->width < hx || sw->y + sw->height < hy)
+      continue;
+    /* check to see if it belongs to another xwrits process */
+    if (check_xwrits_window(port, sw->w)) {
+      sw->xwrits = 1;
+      continue;
+    }
+    /* if we get here, we found an illegal overlap */
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/* Raising windows */
+
+/* Another client that also keeps itself on top can answer each of our raises
+   with one of its own. A Raiser lets raises that come quickly after the
+   last one wait, doubling the wait while the fight goes on, so neither
+   client spins. A deferred raise still happens when its wait is over. */
+
+#define RAISE_STORM_SEC		1	/* raises closer than this back off */
+#define RAISE_MIN_BACKOFF_MSEC	125
+#define RAISE_MAX_BACKOFF_SEC	8
+
+static int raise_count;
+static int raise_deferred_count;
+static Xwtime raise_count_time;
+
+void
+init_raiser(Raiser *r, Port *port, Window w, void (*raised)(Raiser *))
+{
+  r->port = port;
+  r->w = w;
+  r->raised = raised;
+  r->last = -RAISE_STORM_SEC * (Xwtime)NANO_PER_SEC;
+  r->backoff = 0;
+  r->deferred = 0;
+}
+
+static void
+do_raise(Raiser *r, const Xwtime *now)
+{
+  Xwtime storm;
+  xwSETTIME(storm, RAISE_STORM_SEC, 0);
+  if (*now - r->last < storm) {
+    r->backoff *= 2;
+    if (r->backoff < RAISE_MIN_BACKOFF_MSEC * (Xwtime)NANO_PER_MSEC)
+      r->backoff = RAISE_MIN_BACKOFF_MSEC * (Xwtime)NANO_PER_MSEC;
+    if (r->backoff > RAISE_MAX_BACKOFF_SEC * (Xwtime)NANO_PER_SEC)
+      r->backoff = RAISE_MAX_BACKOFF_SEC * (Xwtime)NANO_PER_SEC;
+  } else
+    r->backoff = 0;
+  r->last = *now;
+
+  XRaiseWindow(r->port->display, r->w);
+  if (r->raised)
+    r->raised(r);
+
+  raise_count++;
+  if (*now - raise_count_time >= SEC_PER_MIN * (Xwtime)NANO_PER_SEC) {
+    if (verbose && (raise_count > 1 || raise_deferred_count))
+      fprintf(stderr, "Raised windows %d times (%d deferred) in %ld sec\n",
+	      raise_count, raise_deferred_count,
+	      (long)xwTIMESEC(*now - raise_count_time));
+    raise_count = raise_deferred_count = 0;
+    raise_count_time = *now;
+  }
+}
+
+void
+request_raise(Raiser *r, const Xwtime *now)
+{
+  Alarm *a;
+  if (r->deferred)
+    return;
+  if (xwTIMEGEQ(*now, r->last + r->backoff)) {
+    do_raise(r, now);
+    return;
+  }
+  a = new_alarm_data(A_RAISE, r, 0);
+  a->timer = r->last + r->backoff;
+  schedule(a);
+  r->deferred = 1;
+  raise_deferred_count++;
+}
+
+void
+deferred_raise(Alarm *a, const Xwtime *now)
+{
+  Raiser *r = (Raiser *)a->data1;
+  r->deferred = 0;
+  do_raise(r, now);
+}
+
+void
+cancel_raise(Raiser *r)
+{
+  if (r->deferred) {
+    unschedule_data(A_RAISE, r);
+    r->deferred = 0;
+  }
+}
+
+
+/* With an EWMH window manager, _NET_WM_STATE_ABOVE keeps +top hands above
+   ordinary windows, so they are rarely obscured in the first place. */
+
+static int
+wm_supports_above(Port *port)
+{
+  Atom actual_type;
+  int actual_format;
+  unsigned long nitems, bytes_after, i;
+  union { unsigned char *uc; Atom *a; } prop;
+
+  if (port->wm_supports_above >= 0)
+    return port->wm_supports_above;
+  port->wm_supports_above = 0;
+  if (XGetWindowProperty(port->display, port->root_window,
+			 port->net_supported_atom, 0, 1024, False, XA_ATOM,
+			 &actual_type, &actual_format, &nitems, &bytes_after,
+			 &prop.uc) == Success && prop.uc) {
+    if (actual_type == XA_ATOM && actual_format == 32)
+      for (i = 0; i < nitems; i++)
+	if (prop.a[i] == port->net_wm_state_above_atom)
+	  port->wm_supports_above = 1;
+    XFree(prop.uc);
+  }
+  return port->wm_supports_above;
+}
+
+void
+set_hand_above(Hand *h, int above)
+{
+  Port *port = h->port;
+  h->above = (above != 0);
+  if (!wm_supports_above(port))
+    return;
+
+  if (h->configured && !h->withdrawn) {
+    /* the window manager owns _NET_WM_STATE; ask it */
+    XEvent e;
+    e.xclient.type = ClientMessage;
+    e.xclient.window = h->w;
+    e.xclient.message_type = port->net_wm_state_atom;
+    e.xclient.format = 32;
+    e.xclient.data.l[0] = (above ? 1 : 0); /* _NET_WM_STATE_ADD/REMOVE */
+    e.xclient.data.l[1] = port->net_wm_state_above_atom;
+    e.xclient.data.l[2] = 0;
+    e.xclient.data.l[3] = 1;	/* source indication: application */
+    e.xclient.data.l[4] = 0;
+    XSendEvent(port->display, port->root_window, False,
+	       SubstructureRedirectMask | SubstructureNotifyMask, &e);
+  } else if (above)
+    XChangeProperty(port->display, h->w, port->net_wm_state_atom,
+		    XA_ATOM, 32, PropModeReplace,
+		    (unsigned char *)&port->net_wm_state_above_atom, 1);
+  else
+    XDeleteProperty(port->display, h->w, port->net_wm_state_atom);
+}
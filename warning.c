@@ -5,7 +5,7 @@
 #include <X11/Xatom.h>
 
 static int clock_displaying = 0;
-static struct timeval this_warn_time;
+static Xwtime this_warn_time;
 
 
 static void
@@ -21,8 +21,8 @@ pop_up_hand(Hand *h)
 
 
 static int
-switch_options(Options *opt, const struct timeval *option_switch_time,
-	       const struct timeval *now)
+switch_options(Options *opt, const Xwtime *option_switch_time,
+	       const Xwtime *now)
 {
   Hand *h;
   Alarm *a;
@@ -55,6 +55,9 @@ switch_options(Options *opt, const struct timeval *option_switch_time,
   }
 
   for (i = 0; i < nports; i++) {
+    for (h = ports[i]->hands; h; h = h->next)
+      if (h->above != opt->top)
+	set_hand_above(h, opt->top);
     for (h = ports[i]->hands; h; h = h->next)
       if ((opt->never_iconify && !h->mapped) ||
 	  (!opt->appear_iconified && h->icon->mapped))
@@ -90,7 +93,7 @@ schedule_warn_idle(Alarm *a)
 
 
 static int
-warn_alarm_loop(Alarm *a, const struct timeval *now)
+warn_alarm_loop(Alarm *a, const Xwtime *now)
 {
   switch (a->action) {
 
@@ -114,60 +117,7 @@ warn_alarm_loop(Alarm *a, const struct timeval *now)
 
 
 static int
-check_raise_window(Hand *h)
-{
-  Port *port = h->port;
-  Window root, parent, *children = 0;
-  unsigned nchildren;
-  unsigned i;
-  int hx, hy, ox, oy;
-  int hwidth, hheight, owidth, oheight;
-  unsigned border, depth;
-  Hand *trav;
-  int bad_overlap;
-
-  /* find our geometry */
-  XGetGeometry(port->display, h->root_child, &root, &hx, &hy,
-	       (unsigned *)&hwidth, (unsigned *)&hheight, &border, &depth);
-
-  /* find our position in the stacking order */
-  if (!XQueryTree(port->display, port->root_window, &root, &parent,
-		  &children, &nchildren)) {
-    if (children) XFree(children);
-    return 0;
-  }
-  for (i = 0; i < nchildren; i++)
-    if (children[i] == h->root_child)
-      break;
-
-  /* examine higher windows in the stacking order */
-  bad_overlap = 0;
-  for (i++; i < nchildren && !bad_overlap; i++) {
-    /* overlap by other hands is OK */
-    for (trav = port->hands; trav; trav = trav->next)
-      if (children[i] == trav->root_child)
-	goto overlap_ok;
-    /* check to see that this window actually overlaps us */
-    XGetGeometry(port->display, children[i], &root, &ox, &oy,
-		 (unsigned *)&owidth, (unsigned *)&oheight, &border, &depth);
-    if (ox > hx + hwidth || oy > hy + hheight
-	|| ox + owidth < hx || oy + oheight < hy)
-      goto overlap_ok;
-    /* check to see if it belongs to another xwrits process */
-    if (check_xwrits_window(port, children[i]))
-      goto overlap_ok;
-    /* if we get here, we found an illegal overlap */
-    bad_overlap = 1;
-   overlap_ok: ;
-  }
-
-  if (children)
-    XFree(children);
-  return bad_overlap;
-}
-
-static int
-warn_x_loop(XEvent *e, const struct timeval *now)
+warn_x_loop(XEvent *e, const Xwtime *now)
 {
   Alarm *a;
   Hand *h;
@@ -216,7 +166,7 @@ warn_x_loop(XEvent *e, const struct timeval *now)
      h = window_to_hand(port, e->xvisibility.window, 0);
      if (h && h->obscured && ocurrent->top)
        if (check_raise_window(h))
-	 XRaiseWindow(port->display, h->w);
+	 request_raise(&h->raiser, now);
      break;
    }
 
@@ -228,7 +178,7 @@ warn_x_loop(XEvent *e, const struct timeval *now)
 int
 warn(int was_lock, Options *onormal)
 {
-  struct timeval option_switch_time;
+  Xwtime option_switch_time;
   int i, val;
 
   clock_displaying = 0;
@@ -239,7 +189,7 @@ warn(int was_lock, Options *onormal)
   ocurrent = onormal;
   option_switch_time = first_warn_time;
   while (ocurrent->next) {
-    struct timeval next;
+    Xwtime next;
     xwADDTIME(next, option_switch_time, ocurrent->next_delay);
     if (xwTIMEGT(next, this_warn_time))
       break;
@@ -9,8 +9,11 @@
 #ifdef HAVE_XSS
 #include <X11/extensions/scrnsaver.h>
 #endif
-#ifndef FD_SET
-#include <sys/select.h>
+#ifdef HAVE_XSYNC
+#include <X11/extensions/sync.h>
+#endif
+#ifdef HAVE_XI2
+#include <X11/extensions/XInput2.h>
 #endif
 #include <lcdfgif/gif.h>
 #include <lcdfgif/gifx.h>
@@ -19,7 +22,14 @@ typedef struct Port Port;
 typedef struct Options Options;
 typedef struct Hand Hand;
 typedef struct PictureList PictureList;
+typedef struct Frame Frame;
 typedef struct Alarm Alarm;
+typedef struct StackWindow StackWindow;
+typedef struct Raiser Raiser;
+
+/* An Xwtime is a signed count of nanoseconds. Points in time count from
+   genesis_time on a clock that never jumps backwards. */
+typedef int64_t Xwtime;
 
 #ifdef __cplusplus
 #define EXTERNFUNCTION		extern "C"
@@ -65,6 +75,8 @@ struct Port {
   GC white_gc;			/* foreground white, font font */
   GC clock_fore_gc;		/* foreground black, thick rounded line */
   GC clock_hand_gc;		/* same as clock_fore_gc */
+  Pixmap clock_face;		/* blank clock, drawn through clock_face_gc */
+  GC clock_face_gc;		/* clipped to the clock's shape */
 
   Gif_XContext *gfx;		/* GIF X context */
 
@@ -77,6 +89,12 @@ struct Port {
   Atom net_wm_window_type_atom;
   Atom net_wm_window_type_utility_atom;
   Atom net_wm_pid_atom;
+  Atom net_wm_icon_atom;
+  Atom net_supported_atom;
+  Atom net_wm_state_atom;
+  Atom net_wm_state_above_atom;
+  Atom net_workarea_atom;
+  Atom net_current_desktop_atom;
   Atom xwrits_window_atom;	/* atoms for communication with other xwrits */
   Atom xwrits_notify_peer_atom;
   Atom xwrits_break_atom;
@@ -92,8 +110,40 @@ struct Port {
   int last_mouse_x;		/* last X position of mouse */
   int last_mouse_y;		/* last Y position of mouse */
 
+  int xi2_opcode;		/* XInputExtension opcode, if raw events used */
+  int xi2_activity;		/* raw input seen during this loop pass */
+  Time xi2_key_time;		/* server time of last raw key/button press */
+  Time xi2_motion_time;		/* start of current raw motion window */
+  double xi2_motion_x;		/* raw motion accumulated in that window */
+  double xi2_motion_y;
+
+  int sync_event_base;		/* SYNC event base, if IDLETIME alarms used */
+  XID idle_alarm;		/* IDLETIME rises to check_xss_time; None on
+				   ports sharing another Port's alarms */
+  XID active_alarm;		/* IDLETIME falls back below it */
+  int idle;			/* has idle_alarm fired since last input? */
+
   Pixmap bars_pixmap;		/* bars background for lock screen */
 
+  StackWindow *stack;		/* model of root's children, bottom first */
+  int nstack;
+  int stack_capacity;
+  int stack_tracked;		/* is the model being maintained? */
+  long root_event_mask;		/* events always selected on the root,
+				   besides keystroke watching */
+  int wm_supports_above;	/* _NET_WM_STATE_ABOVE supported? -1 = ask */
+
+  unsigned short *occupancy;	/* hands covering each placement cell */
+  unsigned *occupancy_sat;	/* summed-area table of occupancy */
+  int occupancy_w;
+  int occupancy_h;
+  int occupancy_dirty;		/* must occupancy_sat be rebuilt? */
+  int has_workarea;		/* is the _NET_WORKAREA cache valid? */
+  int workarea_left;
+  int workarea_top;
+  int workarea_right;
+  int workarea_bottom;
+
   Window *peers;		/* list of peer windows */
   int npeers;
   int peers_capacity;
@@ -103,14 +153,29 @@ struct Port {
 extern int nports;
 extern Port **ports;
 
-extern fd_set x_socket_set;
-extern int max_x_socket;
-
 Port *find_port(Display *, Window);
 
 void mark_xwrits_window(Port *, Window);
 Window check_xwrits_window(Port *, Window);
 
+void stack_event(XEvent *);
+int check_raise_window(Hand *);
+
+struct Raiser {
+  Port *port;
+  Window w;
+  void (*raised)(Raiser *);	/* called after each raise, or 0 */
+  Xwtime last;			/* time of the last raise */
+  Xwtime backoff;		/* wait at least this long for the next */
+  int deferred;			/* is an A_RAISE alarm pending? */
+};
+
+void init_raiser(Raiser *, Port *, Window, void (*)(Raiser *));
+void request_raise(Raiser *, const Xwtime *);
+void deferred_raise(Alarm *, const Xwtime *);
+void cancel_raise(Raiser *);
+void set_hand_above(Hand *, int);
+
 /* fake X event types */
 #define Xw_DeleteWindow		(LASTEvent + 100)
 #define Xw_TakeBreak		(LASTEvent + 101)
@@ -127,9 +192,9 @@ void notify_peers_rest(void);
 
 struct Options {
 
-  struct timeval break_time;		/* length of break */
-  struct timeval min_break_time;	/* minimum length of break (+quota) */
-  struct timeval cancel_type_time;	/* typing OK for TIME after cancel */
+  Xwtime break_time;		/* length of break */
+  Xwtime min_break_time;	/* minimum length of break (+quota) */
+  Xwtime cancel_type_time;	/* typing OK for TIME after cancel */
 
   Gif_Stream *slideshow;		/* warn window animation  */
   Gif_Stream *icon_slideshow;		/* warn icon window animation */
@@ -138,8 +203,8 @@ struct Options {
   const char *window_title;
 
   double flash_rate_ratio;		/* <1, flash fast; >1, flash slow */
-  struct timeval multiply_delay;	/* time between window multiplies */
-  struct timeval lock_bounce_delay;	/* time between lock bounces */
+  Xwtime multiply_delay;	/* time between window multiplies */
+  Xwtime lock_bounce_delay;	/* time between lock bounces */
 
   unsigned beep: 1;			/* beep when bringing up a warn? */
   unsigned clock: 1;			/* show clock for time since warn? */
@@ -153,7 +218,7 @@ struct Options {
   unsigned break_clock: 1;		/* show clock time left in break? */
   int max_hands;			/* max number of hands (+multiply) */
 
-  struct timeval next_delay;		/* delay till go to next options */
+  Xwtime next_delay;		/* delay till go to next options */
   Options *next;			/* next options */
   Options *prev;			/* previous options */
 
@@ -161,22 +226,22 @@ struct Options {
 
 extern Options *ocurrent;
 
-extern struct timeval type_delay;
+extern Xwtime type_delay;
 
 #define MAX_PASSWORD_SIZE 256
-extern struct timeval lock_message_delay;
+extern Xwtime lock_message_delay;
 extern char *lock_password;
 
 
 /*****************************************************************************/
 /*  Clocks								     */
 
-extern struct timeval clock_zero_time;
-extern struct timeval clock_tick;
+extern Xwtime clock_zero_time;
+extern Xwtime clock_tick;
 
 void init_clock(Port *);
-void draw_clock(Hand *, const struct timeval *);
-void draw_all_clocks(const struct timeval *);
+void draw_clock(Hand *, const Xwtime *);
+void draw_all_clocks(const Xwtime *);
 void erase_clock(Hand *);
 void erase_all_clocks(void);
 
@@ -195,22 +260,28 @@ void erase_all_clocks(void);
 #define A_IDLE_CHECK		0x0100
 #define A_MOUSE			0x0200
 #define A_XSS_CHECK			0x0400
+#define A_PRERENDER		0x0800
+#define A_RAISE			0x1000
 
 struct Alarm {
 
-  Alarm *next;
-  Alarm *prev;
-  struct timeval timer;
+  Xwtime timer;
+  Xwtime slack;			/* may fire up to this much after timer */
   int action;
   void *data1;
   void *data2;
 
+  int heap_index;		/* position in the scheduler's timer heap */
+  unsigned long sequence;	/* orders alarms with equal timers */
+  Alarm *hash_next;		/* chain in the (action, data1) index */
+  Alarm **hash_pprev;
+
   unsigned scheduled: 1;
 
 };
 
-typedef int (*Alarmloopfunc)(Alarm *, const struct timeval *);
-typedef int (*Xloopfunc)(XEvent *, const struct timeval *);
+typedef int (*Alarmloopfunc)(Alarm *, const Xwtime *);
+typedef int (*Xloopfunc)(XEvent *, const Xwtime *);
 
 #define new_alarm(i)	new_alarm_data((i), 0, 0)
 Alarm *new_alarm_data(int, void *, void *);
@@ -225,6 +296,11 @@ void unschedule_data(int, void *);
 
 int loopmaster(Alarmloopfunc, Xloopfunc);
 
+typedef void (*Fdloopfunc)(int, void *);
+void watch_display(Port *);
+void watch_fd(int, Fdloopfunc, void *);
+void unwatch_fd(int);
+
 
 /*****************************************************************************/
 /*  Hands								     */
@@ -235,6 +311,7 @@ struct Hand {
 
   Hand *next;
   Hand *prev;
+  Hand *hash_next;		/* next hand in window index bucket */
   Hand *icon;
 
   Port *port;
@@ -249,6 +326,14 @@ struct Hand {
   Gif_Stream *slideshow;
   int slide;
   int loopcount;
+  int clock_minutes;		/* minutes shown on the clock, or -1 */
+
+  int occupy_x0;		/* placement cells counted for this hand */
+  int occupy_y0;
+  int occupy_x1;
+  int occupy_y1;
+
+  Raiser raiser;			/* raises h->w on VisibilityNotify */
 
   unsigned is_icon: 1;
   unsigned mapped: 1;
@@ -258,6 +343,8 @@ struct Hand {
   unsigned clock: 1;
   unsigned permanent: 1;
   unsigned toplevel: 1;
+  unsigned above: 1;		/* want _NET_WM_STATE_ABOVE? */
+  unsigned occupying: 1;	/* counted in port->occupancy? */
 
 };
 
@@ -269,9 +356,13 @@ int active_hands(void);
 Hand *new_hand(Port *, int x, int y);
 Hand *new_hand_subwindow(Port *, Window parent, int x, int y);
 void destroy_hand(Hand *);
+void update_hand_occupancy(Hand *);
+void update_workarea(Port *);
+void set_hand_mapped(Hand *, int mapped);
 Hand *find_one_hand(Port *, int mapped);
 
 Hand *window_to_hand(Port *, Window, int allow_icon);
+Hand *display_window_to_hand(Display *, Window);
 void hand_map_raised(Hand *);
 
 void draw_slide(Hand *);
@@ -287,8 +378,13 @@ extern Gif_Stream *locked_slideshow, *bars_slideshow;
 #define DEFAULT_FLASH_DELAY_SEC 2
 
 Gif_Stream *parse_slideshow(const char *, double, int mono);
-void set_slideshow(Hand *, Gif_Stream *, const struct timeval *);
+void set_slideshow(Hand *, Gif_Stream *, const Xwtime *);
 void set_all_slideshows(Hand *, Gif_Stream *);
+Pixmap slide_pixmap(Gif_Stream *, int slide, Port *);
+void init_frame_cache(const char *dir);
+
+void prerender_slideshow(Gif_Stream *);
+void prerender_slide(Alarm *, const Xwtime *);
 
 
 /*****************************************************************************/
@@ -299,7 +395,8 @@ struct PictureList {
   int clock_y_off;
   Gif_Stream *gfs;
   int refcount;
-  Gif_XFrame *frames[1];
+  Frame **frame;		/* shared frame for each image in gfs */
+  Gif_XFrame *frames[1];	/* per port; pixmaps belong to the Frames */
 };
 
 void default_pictures(void);
@@ -309,33 +406,39 @@ void load_needed_pictures(Window, int, int force_mono);
 /*****************************************************************************/
 /*  Idle processing							     */
 
-extern struct timeval register_keystrokes_delay;
-extern struct timeval register_keystrokes_gap;
+extern Xwtime register_keystrokes_delay;
+extern Xwtime register_keystrokes_gap;
 
-extern struct timeval last_key_time;	/* time of last keystroke/equivalent */
+extern Xwtime last_key_time;	/* time of last keystroke/equivalent */
 
 extern int check_idle;			/* check for idle periods? */
-extern struct timeval idle_time;	/* idle period of idle_time = break */
+extern Xwtime idle_time;	/* idle period of idle_time = break */
 
 extern int check_mouse;			/* pay attention to mouse movement? */
-extern struct timeval check_mouse_time;	/* next time to check mouse pos */
+extern Xwtime check_mouse_time;	/* next time to check mouse pos */
 extern int mouse_sensitivity;		/* movement > sensitivity = keypress */
+extern Xwtime mouse_grace_time;	/* ignore raw motion before this */
 
 extern int check_quota;			/* use quota system? */
-extern struct timeval quota_time;	/* if idle more than quota_time,
+extern Xwtime quota_time;	/* if idle more than quota_time,
 					   count idle time towards break */
-extern struct timeval quota_allotment;	/* counted towards break */
+extern Xwtime quota_allotment;	/* counted towards break */
 
 extern int max_cheats;			/* allow this many cheat events before
 					   cancelling break */
 
 extern int check_xss;			/* use xss */
-extern struct timeval check_xss_time;	/* next time to check xss */
+extern Xwtime check_xss_time;	/* next time to check xss */
+
+extern int check_xi2;			/* use XInput2 raw events */
+extern int check_keystrokes;		/* crawl windows for keystrokes */
 
 extern int verbose;			/* be verbose */
 
-void watch_keystrokes(Port *, Window, const struct timeval *);
+void watch_keystrokes(Port *, Window, const Xwtime *);
 void register_keystrokes(Port *, Window);
+int watch_raw_input(Port *);
+int watch_idle_time(Port *);
 
 
 /*****************************************************************************/
@@ -352,11 +455,11 @@ void message(const char *, ...);
 #define TRAN_LOCK	5
 #define TRAN_AWAKE	6
 
-extern struct timeval first_warn_time;
+extern Xwtime first_warn_time;
 
-int wait_for_break(const struct timeval *type_time);
+int wait_for_break(const Xwtime *type_time);
 int warn(int was_lock, Options *first_options);
-void calculate_break_time(struct timeval *break_over_time, const struct timeval *now);
+void calculate_break_time(Xwtime *break_over_time, const Xwtime *now);
 int rest(void);
 int lock(void);
 
@@ -367,73 +470,50 @@ void unmap_all(void);
 /*****************************************************************************/
 /*  Time functions							     */
 
-#define MICRO_PER_SEC 1000000
+#define NANO_PER_SEC 1000000000
+#define NANO_PER_MSEC 1000000
+#define NANO_PER_USEC 1000
 #define SEC_PER_MIN 60
 #define MIN_PER_HOUR 60
 #define HOUR_PER_CYCLE 12
 
-#define xwSETTIME(timeval, sec, usec) do { \
-	(timeval).tv_sec = (sec); (timeval).tv_usec = (usec); \
-	} while (0)
-
-#define xwADDTIME(result, a, b) do { \
-	(result).tv_sec = (a).tv_sec + (b).tv_sec; \
-	if (((result).tv_usec = (a).tv_usec+(b).tv_usec) >= MICRO_PER_SEC) { \
-		(result).tv_sec++; \
-		(result).tv_usec -= MICRO_PER_SEC; \
-	} } while (0)
+#define xwSETTIME(t, sec, usec) \
+	((t) = (Xwtime)(sec) * NANO_PER_SEC + (Xwtime)(usec) * NANO_PER_USEC)
+#define xwTIMESEC(t)		((t) / NANO_PER_SEC)
+#define xwTIMEMSEC(t)		((t) / NANO_PER_MSEC)
 
-#define xwSUBTIME(result, a, b) do { \
-	(result).tv_sec = (a).tv_sec - (b).tv_sec; \
-	if (((result).tv_usec = (a).tv_usec - (b).tv_usec) < 0) { \
-		(result).tv_sec--; \
-		(result).tv_usec += MICRO_PER_SEC; \
-	} } while (0)
+#define xwADDTIME(result, a, b)	((result) = (a) + (b))
+#define xwSUBTIME(result, a, b)	((result) = (a) - (b))
+#define xwSETMINTIME(a, b)	do { if ((b) < (a)) (a) = (b); } while (0)
 
-#define xwSETMINTIME(a, b) do { \
-	if ((b).tv_sec < (a).tv_sec || \
-	    ((b).tv_sec == (a).tv_sec && (b).tv_usec < (a).tv_usec)) \
-		(a) = (b); \
-	} while (0)
+#define xwTIMEGEQ(a, b)		((a) >= (b))
+#define xwTIMEGT(a, b)		((a) > (b))
+#define xwTIMELEQ0(a)		((a) <= 0)
+#define xwTIMELT0(a)		((a) < 0)
 
-#define xwTIMEGEQ(a, b) ((a).tv_sec > (b).tv_sec || \
-	((a).tv_sec == (b).tv_sec && (a).tv_usec >= (b).tv_usec))
-
-#define xwTIMEGT(a, b) ((a).tv_sec > (b).tv_sec || \
-	((a).tv_sec == (b).tv_sec && (a).tv_usec > (b).tv_usec))
-
-#define xwTIMELEQ0(a) ((a).tv_sec < 0 || ((a).tv_sec == 0 && (a).tv_usec <= 0))
-#define xwTIMELT0(a)  ((a).tv_sec < 0 || ((a).tv_sec == 0 && (a).tv_usec < 0))
-
-
-#ifdef X_GETTIMEOFDAY
-# define xwGETTIMEOFDAY(a) X_GETTIMEOFDAY(a)
-#elif GETTIMEOFDAY_PROTO == 0
+#ifndef HAVE_CLOCK_GETTIME
+# ifdef X_GETTIMEOFDAY
+#  define xwGETTIMEOFDAY(a) X_GETTIMEOFDAY(a)
+# elif GETTIMEOFDAY_PROTO == 0
 EXTERNFUNCTION int gettimeofday(struct timeval *, struct timezone *);
-# define xwGETTIMEOFDAY(a) gettimeofday((a), 0)
-#elif GETTIMEOFDAY_PROTO == 1
-# define xwGETTIMEOFDAY(a) gettimeofday((a))
-#else
-# define xwGETTIMEOFDAY(a) gettimeofday((a), 0)
+#  define xwGETTIMEOFDAY(a) gettimeofday((a), 0)
+# elif GETTIMEOFDAY_PROTO == 1
+#  define xwGETTIMEOFDAY(a) gettimeofday((a))
+# else
+#  define xwGETTIMEOFDAY(a) gettimeofday((a), 0)
+# endif
 #endif
 
-#define xwGETTIME(a) do { xwGETTIMEOFDAY(&(a)); xwSUBTIME((a), (a), genesis_time); } while (0)
-extern struct timeval genesis_time;
-
-#define xwADDDELAY(result, a, d) do { \
-	(result).tv_sec = (a).tv_sec + ((d)/100); \
-	if (((result).tv_usec = (a).tv_usec + ((d)%100)*10000) >= MICRO_PER_SEC) { \
-		(result).tv_sec++; \
-		(result).tv_usec -= MICRO_PER_SEC; \
-	} } while (0)
+Xwtime xwclock(void);
+#define xwGETTIME(a)		((a) = xwclock() - genesis_time)
+extern Xwtime genesis_time;
 
-#define xwSUBDELAY(result, a, d) do { \
-	(result).tv_sec = (a).tv_sec - ((d)/100); \
-	if (((result).tv_usec = (a).tv_usec - ((d)%100)*10000) < 0) { \
-		(result).tv_sec--; \
-		(result).tv_usec += MICRO_PER_SEC; \
-	} } while (0)
+/* GIF delays are in hundredths of a second */
+#define xwADDDELAY(result, a, d) \
+	((result) = (a) + (Xwtime)(d) * 10 * NANO_PER_MSEC)
+#define xwSUBDELAY(result, a, d) \
+	((result) = (a) - (Xwtime)(d) * 10 * NANO_PER_MSEC)
 
-void set_fraction_time(struct timeval *result, struct timeval in, double fraction);
+void set_fraction_time(Xwtime *result, Xwtime in, double fraction);
 
 #endif